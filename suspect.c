@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -9,31 +10,513 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <getopt.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <regex.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <termios.h>
+#include <linux/mount.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define BUFF_LEN 8
+#define READ_LEN 65536  // Bytes asked of each read, write or splice
 
 /* ERRORS */
 #define ERR_COMMAND 1
 #define ERR_BLOCK   2
 #define ERR_LIMIT   3
 #define ERR_OPEN    4
+#define ERR_USAGE   5
+#define ERR_SIGNAL  6
+#define ERR_REGRESS 7
+
+/* COMMANDS, numbered by what their handler returns when it passes */
+#define CMD_EXIT        1
+#define CMD_WANT        2
+#define CMD_SEND        3
+#define CMD_EXISTS      4
+#define CMD_SIZE        5
+#define CMD_ECHO        6
+#define CMD_ENDINPUT    7
+#define CMD_INTERACTIVE 8
+#define CMD_LIMIT       9
+#define CMD_REPEAT      10
+#define CMD_END         11
+#define CMD_INSTANCES   12
+#define CMD_LATENCY     13
+#define CMD_MAXRSS      14
+#define CMD_UTIME       15
+#define CMD_STIME       16
+#define CMD_MAJFLT      17
+#define CMD_NVCSW       18
+#define CMD_NIVCSW      19
+#define CMD_COUNTER     20
+#define CMD_BENCHMARK   21
+#define CMD_NAME        22
+#define CMD_AFTER       23
+#define CMD_LOCK        24
+#define CMD_PTY         25
+#define CMD_PIPESIZE    26
+#define CMD_LAST        CMD_PIPESIZE
+
+/* What the parameters of a command must look like */
+#define ARGS_NONE       0   // Anything or nothing, it's ignored
+#define ARGS_TEXT       1   // Any string
+#define ARGS_WORD       2   // A word, anything after it is ignored
+#define ARGS_NUMBER     3   // An integer followed by a space or nothing
+#define ARGS_COUNT      4   // As ARGS_NUMBER but not negative
+#define ARGS_SIZE       5   // An integer then a word
+#define ARGS_LATENCY    6   // An optional percentile then a duration
+#define ARGS_DURATION   7   // A duration such as 200ms
+#define ARGS_COUNTER    8   // A counter name then a count
+
+/* Commands are found by a perfect hash of their first, third and last
+ * characters and length. The multipliers were found by searching for a
+ * set that gives every command below its own slot, so look up costs
+ * one hash and one compare. make checks that before building, and
+ * searches again if a new command doesn't fit. No command is shorter
+ * than three characters. */
+#define COMMAND_SLOTS 64
+#define COMMAND_HASH(first, third, last, length) \
+    (((first) * 2 + (third) * 28 + (last) * 16 + (length)) & \
+    (COMMAND_SLOTS - 1))
+
+#define HIST_SUB_BITS 5                 // Linear steps per power of two
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
 
 /* These variables are global to make things easier */
 int blockCount = 1;     // Current block number
 int lineCount = 1;      // Current line number
 bool sawExit = false;   // Whether the block had an exit command
 bool sawLimit = false;  // Whether the block had a limit command
-int pRead[2];           // Pipe for reading
-int pWrite[2];          // Pipe for writing
-FILE *readPipe;         // For reading from the pipe
-FILE *writePipe;        // For writing to the pipe
-FILE *errorPipe;        // For checking whether exec succeeded
+int childIn = -1;       // For writing to the child, non-blocking
 pid_t pid = -1;         // The process id, -1 means no child exists
 int childStatus;        // Exit status of the child process
 bool echo = false;      // For checking echo
+int killGrace = 100;    // Milliseconds to wait after each kill signal
+bool timing = false;    // Whether to report how long each block took
+int pipeSize = 0;       // Bytes child pipes should hold, 0 for the default
 
-/* Print an error message then exit the program. */
-void throw_error(int code, int i, char *s)
+/* Signals sent in turn to take down a child's process group */
+const int killSignals[] = {SIGINT, SIGTERM, SIGKILL};
+const char *killNames[] = {"SIGINT", "SIGTERM", "SIGKILL"};
+
+/* Signals are never delivered to handlers. They stay blocked and are
+ * read from a signalfd polled alongside whatever is being waited for,
+ * so they're acted on outside of signal context. */
+int signals = -1;       // The signalfd, -1 once we're going down
+
+/* When the running want or send must be done by, 0 if it has all the
+ * time it needs */
+long long commandDeadline = 0;
+
+/* As subreaper, anything the block's program starts and leaves behind
+ * becomes our child, so all of it can be reaped and accounted for */
+struct rusage blockUsage;   // Used by the block's program and descendants
+struct rusage childUsage;   // Used by the program itself, once exit reaps it
+int orphans = 0;            // Descendants of the block reaped by us
+
+/* Buffered line reader over a raw file descriptor */
+struct reader {
+    int fd;             // Descriptor being read
+    char *buffer;       // Holds bytes read but not yet consumed
+    size_t size;        // Capacity of buffer
+    size_t start;       // First unconsumed byte
+    size_t end;         // One past the last byte read
+    bool eof;           // Whether read() has reported end of file
+    bool echo;          // Whether bytes read are also copied to stdout
+    bool crlf;          // Whether a \r before a newline is dropped
+    int line;           // Line number of the next line read
+    int block;          // Number of the next block read
+};
+
+struct reader *script;  // Source of the script lines
+struct reader *terminal;// Source of interactive input, always stdin
+struct reader *childOut;// For reading from the pipe
+
+/* How echoed output gets to stdout, worked out on first use */
+enum { ECHO_UNKNOWN, ECHO_TEE, ECHO_SPLICE, ECHO_COPY } echoMode;
+int echoPipe[2];        // Holds echoed bytes when stdout isn't a pipe
+
+/* A command word, what it does and what it takes */
+struct command {
+    const char *name;
+    int id;             // Which handler runs it
+    int args;           // Schema its parameters must follow
+};
+
+const struct command commands[COMMAND_SLOTS] = {
+    [1]  = {"maxrss<", CMD_MAXRSS, ARGS_COUNT},
+    [2]  = {"endinput", CMD_ENDINPUT, ARGS_NONE},
+    [5]  = {"benchmark", CMD_BENCHMARK, ARGS_NONE},
+    [9]  = {"limit", CMD_LIMIT, ARGS_NUMBER},
+    [10] = {"exit", CMD_EXIT, ARGS_COUNT},
+    [11] = {"nivcsw<", CMD_NIVCSW, ARGS_COUNT},
+    [16] = {"latency<", CMD_LATENCY, ARGS_LATENCY},
+    [23] = {"after", CMD_AFTER, ARGS_WORD},
+    [26] = {"counter<", CMD_COUNTER, ARGS_COUNTER},
+    [28] = {"name", CMD_NAME, ARGS_WORD},
+    [29] = {"interactive", CMD_INTERACTIVE, ARGS_WORD},
+    [30] = {"echo", CMD_ECHO, ARGS_WORD},
+    [31] = {"instances", CMD_INSTANCES, ARGS_COUNT},
+    [32] = {"lock", CMD_LOCK, ARGS_WORD},
+    [35] = {"size>", CMD_SIZE, ARGS_SIZE},
+    [40] = {"stime<", CMD_STIME, ARGS_DURATION},
+    [42] = {"repeat", CMD_REPEAT, ARGS_COUNT},
+    [44] = {"utime<", CMD_UTIME, ARGS_DURATION},
+    [47] = {"pty", CMD_PTY, ARGS_NONE},
+    [50] = {"send", CMD_SEND, ARGS_TEXT},
+    [54] = {"nvcsw<", CMD_NVCSW, ARGS_COUNT},
+    [56] = {"pipesize", CMD_PIPESIZE, ARGS_COUNT},
+    [57] = {"majflt<", CMD_MAJFLT, ARGS_COUNT},
+    [58] = {"want", CMD_WANT, ARGS_TEXT},
+    [60] = {"exists", CMD_EXISTS, ARGS_TEXT},
+    [61] = {"end", CMD_END, ARGS_NONE}
+};
+
+/* Performance counters kept on a block's program, by perf_event_open
+ * type and config. The hardware ones may not exist in a VM or be
+ * allowed in a container, in which case they're just left out. */
+#define COUNTERS 7
+struct counter {
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+};
+
+const struct counter counterTypes[COUNTERS] = {
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES}
+};
+
+/* Counter descriptors on the block's program, -1 where unavailable */
+int counters[COUNTERS] = {-1, -1, -1, -1, -1, -1, -1};
+
+/* Counts read from the block's program as it was taken down */
+unsigned long long counterValues[COUNTERS];
+bool counted[COUNTERS];         // Whether each could be read
+
+/* Measures taken of each benchmark trial: wall time, what the block
+ * used, then the counters */
+#define METRICS (8 + COUNTERS)
+const char *metricNames[8] = {"wall", "user", "system", "maxrss",
+        "minflt", "majflt", "nvcsw", "nivcsw"};
+
+int trials = 0;         // Times to re-run benchmark blocks, 0 not to
+int warmup = 0;         // Untimed runs of them before the trials
+bool quiet = false;     // Whether blocks keep their results to themselves
+
+/* Trials of a benchmark block saved by an earlier run, found again by a
+ * hash of the block's text. On disk a baseline file is BASELINE_MAGIC,
+ * then the version, METRICS and the number of records as 32 bit ints,
+ * then for each record its hash, its number of trials and its samples,
+ * all in the host's byte order. */
+struct baseline {
+    uint64_t hash;
+    uint32_t trials;
+    double *samples;        // Laid out as for struct block
+    struct baseline *next;
+};
+
+#define BASELINE_MAGIC "SUSPBASE"
+#define BASELINE_VERSION 1
+
+char *compareFile = NULL;   // Baseline benchmarks are checked against
+char *updateFile = NULL;    // Baseline benchmarks are saved to
+double threshold = 5;       // Percent worse a measure may get
+struct baseline *compareBaselines = NULL;   // Read from compareFile
+
+/* A parsed command line of a block */
+struct instruction {
+    int command;        // Command id, 0 if the command isn't valid
+    int args;           // Schema of the command's parameters
+    char *text;         // Copy of the line, command and params point in
+    char *params;       // Everything after the command, NULL if nothing
+    int number;         // Integer argument, if the schema has one
+    char *word;         // Text or word argument, if the schema has one
+    char *wordSpace;    // Room for a word argument to be copied into
+    int line;           // Line number in the script
+    int jump;           // Index of the matching repeat or end
+    char *expanded;     // Room for params with the counter filled in
+    char *input;        // Interactive input taken from the script
+    const char *name;   // Name of the command, NULL if it isn't valid
+    long long deadline; // Nanoseconds a want or send may take, 0 if any
+    long long value;    // Duration or count argument, if the schema has one
+    double percentile;  // Percentile argument as a fraction, 0 if none
+};
+
+/* A block of the script, read in full before it is run */
+struct block {
+    int number;         // Block number
+    int line;           // Line number of the program
+    char *program;      // Program to run, NULL if the block is empty
+    struct instruction *instructions;
+    int count;          // Number of instructions
+    int capacity;       // Room in instructions
+    bool ended;         // Whether a blank line ended the block
+    bool counters;      // Whether it asserts on performance counters
+    bool benchmark;     // Whether it's re-run for trials
+    bool pty;           // Whether its program writes to a pseudo-terminal
+    bool sends;         // Whether anything is written to its program
+    bool wants;         // Whether anything is read from its program
+    int pipeSize;       // Bytes its pipes should hold, 0 for the default
+    int instances;      // Copies of the block to run at once
+    long long started;  // When its program was started
+    long long elapsed;  // Nanoseconds from then until its last command
+    long long teardown; // Nanoseconds spent taking its program down
+    double *samples;    // Each measure of each trial, NAN where missing
+    uint64_t hash;      // FNV-1a hash of its lines, to find its baseline
+    char *name;         // What after calls it, NULL if nothing
+    struct instruction **after; // Its after commands
+    int afterCount;
+    char **locks;       // Names of the locks it holds while it runs
+    int *lockIds;       // Where each of them is in lockQueues
+    int lockCount;
+    int *waits;         // Blocks of its suite script it has to wait for
+    int waitCount;
+    int pending;        // Of its waits, how many have yet to pass
+    int *waiters;       // Blocks of its suite script waiting for it
+    int waiterCount;
+    int state;          // How far its suite has got with it
+    double level;       // Expected time from its start to the suite
+                        // script's end, if everything waiting on it runs
+};
+
+/* Where a suite has got to with a block */
+#define BLOCK_WAITING   0
+#define BLOCK_RUNNING   1
+#define BLOCK_PASSED    2
+#define BLOCK_FAILED    3   // Including when one it waits for failed
+
+/* A script named on the command line and at least HUGE_SCRIPT bytes is
+ * mapped rather than read, and cut at blank lines into chunks of about
+ * CHUNK_SIZE which parser threads turn into blocks ahead of the run.
+ * Chunks are kept small as whatever is parsed ahead makes every fork
+ * slower. */
+#define HUGE_SCRIPT (16 << 20)
+#define CHUNK_SIZE (1 << 16)
+#define MAX_PARSERS 8
+
+/* A run of whole blocks from the mapped script */
+struct chunk {
+    const char *text;       // Where it starts in the mapping
+    size_t length;
+    struct block **blocks;  // What it parsed to, numbered from 1
+    int count;              // Number of blocks
+    int lines;              // Number of lines it held
+    bool parsed;            // Whether blocks and lines are filled in
+    struct chunk *next;     // The chunk after it in the script
+};
+
+/* Chunks of the mapped script on their way from parsers to the run */
+struct splitter {
+    char *map;              // The whole script
+    size_t size;
+    size_t split;           // Bytes cut into chunks so far
+    size_t dropped;         // Bytes whose pages have been given back
+    struct chunk *head;     // Oldest chunk, whose blocks are being run
+    struct chunk *tail;
+    struct chunk *waiting;  // First chunk no parser has taken yet
+    int pending;            // Chunks cut and not yet run
+    int limit;              // Most chunks allowed to be pending
+    int taken;              // Blocks of the head chunk handed out
+    int line;               // Lines before the head chunk
+    int block;              // Blocks before the head chunk
+    int ready;              // eventfd bumped as each chunk is parsed
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // Signalled as each chunk is cut
+};
+
+struct splitter *splitter = NULL;   // Set while running a huge script
+
+/* Where a block starts in the script, as kept in its index file */
+struct block_start {
+    uint64_t offset;        // Byte its program line starts at
+    uint32_t line;          // Line number of that line
+};
+
+/* The index is SCRIPT.index, and is only good for the script with the
+ * device, inode, size and modification time it was made from */
+#define INDEX_MAGIC "SUSPINDX"
+#define INDEX_VERSION 1
+
+/* The blocks picked out of an indexed script, read in turn */
+struct selection {
+    struct block_start *starts; // Every block's start, by number - 1
+    int *picked;            // Numbers of the blocks to run, ascending
+    int count;              // Number of blocks picked
+    int next;               // Which of picked to read next
+    int last;               // Number of the block read last, 0 if none
+};
+
+int firstBlock = 1;         // Range of block numbers to run
+int lastBlock = INT_MAX;
+regex_t filter;             // What picked blocks' programs must match
+bool filtering = false;     // Whether there is a filter
+struct selection *selection = NULL; // Set when only some blocks are run
+
+/* A script file run as part of a suite. Its blocks run in order unless
+ * it has name, after or lock commands, which make its blocks wait only
+ * for the ones they're after and for the locks they hold. */
+struct script {
+    char *path;
+    struct block **blocks;
+    int count;              // Number of blocks
+    int left;               // Blocks yet to pass or fail
+    int passed;             // Blocks that passed
+    int failed;             // First block to fail, count if none
+    int code;               // Error it failed with, 0 if none
+    int where;              // Line or block the error was reported against
+    long long elapsed;      // Time its blocks have taken
+    char *output;           // What its blocks have printed
+    size_t length;
+};
+
+/* A process running one block of a suite */
+struct worker {
+    pid_t pid;              // -1 if there's no block running
+    struct script *script;  // Whose block it's running
+    int block;              // Which of the script's blocks
+    int output;             // memfd the block prints to
+};
+
+/* A block of a suite that's ready to run, once its locks are free */
+struct ready {
+    struct script *script;
+    int block;              // Which of the script's blocks
+};
+
+/* Binary heap of ready blocks, the one to run first at the top */
+struct ready_heap {
+    struct ready *items;
+    int count;
+    int capacity;
+};
+
+/* A lock named by a suite's blocks, and the ready blocks parked until
+ * it's free. While it's free and has any parked, at least one block
+ * holding it is in readyBlocks, so none are forgotten. */
+struct lock_queue {
+    char *name;
+    bool held;              // Whether a running block holds it
+    struct ready_heap parked;
+};
+
+/* How long a block has taken before, kept in the history file */
+struct expected {
+    uint64_t hash;          // Of the block's lines, as for baselines
+    double ns;
+};
+
+#define HISTORY_MAGIC "SUSPHIST"
+#define HISTORY_VERSION 1
+
+int jobs = 0;               // Blocks a suite runs at once, 0 if no suite
+bool isolate = false;       // Whether suite blocks get their own directory
+struct worker *workers = NULL;
+struct instance_result *workerResults = NULL;   // One for each worker
+struct ready_heap readyBlocks;  // Blocks whose waits have all passed
+struct lock_queue *lockQueues = NULL;
+int lockQueueCount = 0;
+char *historyFile = NULL;   // Block times are read from and saved to
+struct expected *history = NULL;    // Sorted by hash up to historySorted
+int historyCount = 0;
+int historySorted = 0;
+double historyGuess = 1e6;  // Expected time of blocks without a history
+
+/* HDR-style histogram of durations in nanoseconds. Each power of two
+ * is split into HIST_SUB linear buckets, so values are kept to within
+ * about 3% without any allocation while recording. */
+struct histogram {
+    unsigned long long counts[HIST_SIZE];
+    unsigned long long total;   // Number of values recorded
+};
+
+struct histogram loopLatency;   // Send to want time of repeat iterations
+
+/* Each send is timed to the next want that passes, over the block */
+struct histogram exchangeLatency;   // Times of the block's exchanges
+long long lastExchange;             // Time of its latest exchange
+
+/* What one copy of a block run by instances found */
+struct instance_result {
+    int code;           // Error code it failed with, 0 if it passed
+    int where;          // Line or block the failure was reported against
+    long long elapsed;  // Nanoseconds it took to run
+    struct histogram latency;   // Its repeat iteration times
+};
+
+/* Where to put the result when running as one of several instances */
+struct instance_result *instanceResult = NULL;
+
+/* The same for a suite's worker, whose block still reports as usual to
+ * the output held for its script */
+struct instance_result *workerResult = NULL;
+
+/* A program found once and kept open so later blocks can exec it
+ * without searching the PATH again */
+struct program {
+    char *name;         // First word of the block's program line
+    char *path;         // Where it was found
+    int fd;             // O_PATH descriptor held on it
+    dev_t dev;          // Device, inode and modification time of the
+    ino_t ino;          // file when it was found, so a program replaced
+    struct timespec mtime;  // part way through the run can be noticed
+    struct program *next;
+};
+
+struct program *programs = NULL;    // Programs found so far
+
+/* A program started for a block, and the pipes to it */
+struct child {
+    pid_t pid;          // The process id, -1 means no child exists
+    int in;             // For writing to its stdin
+    int out;            // For reading from its stdout
+    int status;         // Closed by exec, or given errno if exec fails
+    int go;             // Closing this lets a held child exec, -1 if none
+    int counters[COUNTERS]; // Counting from its exec, -1 if not
+    bool pty;           // Whether out is a pseudo-terminal
+};
+
+/* The next block's child, forked while this block finishes but held
+ * back from exec until this block's orphans have all been reaped, so
+ * nothing of the next block's can be mistaken for one */
+struct child prepared = {-1, -1, -1, -1, -1};
+
+void terminate_group(pid_t leader, bool reaped);
+void reap_orphans(void);
+int wait_for_events(struct pollfd *fds, nfds_t n, int timeout);
+void handle_signals(void);
+void trace_flush(void);
+void stop_workers(void);
+bool count_block(struct block *b);
+
+/* Print the message for an error */
+void print_error(int code, int i, char *s)
 {
     switch(code) {
         case ERR_COMMAND:
@@ -48,15 +531,486 @@ void throw_error(int code, int i, char *s)
         case ERR_OPEN:
             printf("Failed to open %s.\n", s);
             break;
+        case ERR_SIGNAL:
+            printf("Block %d interrupted.\n", i);
+            break;
+        case ERR_REGRESS:
+            printf("Block %d regressed.\n", i);
+            break;
+        case ERR_USAGE:
+            fprintf(stderr, "Usage: %s [--grace MS] [--pipe-size N] "
+                    "[--timing] "
+                    "[--trials N [--warmup K] [--compare-baseline FILE] "
+                    "[--update-baseline FILE] [--threshold PCT]] "
+                    "[--trace FILE] [--only-block N | --blocks A-B] "
+                    "[--filter REGEX] [script]\n"
+                    "       %s [--grace MS] [--pipe-size N] [--timing] "
+                    "[--trace FILE] [-j N] [--history FILE] "
+                    "[--isolate] script|directory...\n", s, s);
+            break;
+    }
+}
+
+/* Print an error message then exit the program. */
+void throw_error(int code, int i, char *s)
+{
+    /* Going down, so no more signals to act on */
+    if(signals >= 0) {
+        close(signals);
+        signals = -1;
+    }
+
+    /* An instance leaves its failure for the parent to report */
+    if(instanceResult != NULL) {
+        instanceResult->code = code;
+        instanceResult->where = i;
+        if(pid != -1) {
+            terminate_group(pid, sawExit);
+        }
+        reap_orphans();
+        fflush(stdout);
+        trace_flush();
+        _exit(code);
+    }
+
+    /* A suite's scripts report for themselves as they're stopped */
+    if(workers != NULL) {
+        stop_workers();
     }
+    if(workers == NULL || code != ERR_SIGNAL) {
+        print_error(code, i, s);
+    }
+    fflush(stdout);
 
     /* Don't try to kill a child which doesn't exist */
     if(pid != -1) {
-        kill(pid, SIGINT);
+        terminate_group(pid, sawExit);
+    }
+    if(prepared.pid != -1) {
+        terminate_group(prepared.pid, false);
     }
+    reap_orphans();
+    trace_flush();
     exit(code);
 }
 
+/* Nanoseconds on the monotonic clock */
+long long now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* A struct timeval in nanoseconds */
+long long timeval_ns(struct timeval *t)
+{
+    return t->tv_sec * 1000000000LL + t->tv_usec * 1000LL;
+}
+
+/* Milliseconds poll may wait before commandDeadline, rounded up so it
+ * wakes no earlier, or -1 if there isn't one */
+int deadline_timeout(void)
+{
+    if(commandDeadline == 0) {
+        return -1;
+    }
+    long long left = commandDeadline - now_ns();
+    return left > 0 ? (left + 999999) / 1000000 : 0;
+}
+
+/* Whether commandDeadline has been passed */
+bool deadline_passed(void)
+{
+    return commandDeadline != 0 && now_ns() >= commandDeadline;
+}
+
+/* Bucket holding the value v */
+int histogram_index(unsigned long long v)
+{
+    if(v < HIST_SUB) {
+        return v;
+    }
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Largest value that falls in bucket i */
+unsigned long long histogram_value(int i)
+{
+    if(i < HIST_SUB) {
+        return i;
+    }
+    int shift = i / HIST_SUB - 1;
+    unsigned long long low = (unsigned long long)(HIST_SUB + i % HIST_SUB)
+            << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void histogram_record(struct histogram *h, long long v)
+{
+    h->counts[histogram_index(v < 0 ? 0 : v)]++;
+    h->total++;
+}
+
+/* Value below which the fraction p of the recorded values fall */
+unsigned long long histogram_percentile(struct histogram *h, double p)
+{
+    unsigned long long target = (unsigned long long)(p * h->total + 0.999);
+    unsigned long long seen = 0;
+
+    if(target == 0) {
+        target = 1;
+    }
+    for(int i = 0; i < HIST_SIZE; i++) {
+        if((seen += h->counts[i]) >= target) {
+            return histogram_value(i);
+        }
+    }
+    return 0;
+}
+
+void histogram_reset(struct histogram *h)
+{
+    if(h->total > 0) {
+        memset(h, 0, sizeof(struct histogram));
+    }
+}
+
+/* Write all n bytes of buffer to fd. Returns -1 on error */
+int write_all(int fd, const char *buffer, size_t n)
+{
+    ssize_t written;
+    while(n > 0) {
+        if((written = write(fd, buffer, n)) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        n -= written;
+    }
+    return 0;
+}
+
+/* Tracing, in Chrome's trace event format. Each thread records events
+ * in a buffer of its own, so recording takes no lock, and formats and
+ * appends them in one write when it fills or the run ends. Appends from
+ * instances running at once don't interleave, and the format lets the
+ * closing ] be left off, so the file can be read as it is at any time.
+ * In a suite each worker is shown as a process of its own, numbered
+ * from 1, with its instances as tracks under it. */
+#define TRACE_EVENTS 4096
+
+struct trace_event {
+    const char *name;
+    char phase;         // 'X' for a slice, 'i' for an instant
+    int block;          // Block and line it happened at
+    int line;
+    long long start;    // Nanoseconds on the monotonic clock
+    long long duration;
+};
+
+int traceFd = -1;       // Trace file, -1 if not tracing
+pid_t traceProcess;     // Process every track is shown under
+int traceTrack = 0;     // Track of this process, one for each instance
+__thread struct trace_event *traceEvents = NULL;
+__thread int traceCount = 0;
+
+/* Append s to p, returning the new end */
+char *put_string(char *p, const char *s)
+{
+    while(*s != '\0') {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+/* Append s to p as put_string does, escaping quotes and backslashes so
+ * a script's path can be an event's name */
+char *put_name(char *p, const char *s)
+{
+    while(*s != '\0') {
+        if(*s == '"' || *s == '\\') {
+            *p++ = '\\';
+        }
+        *p++ = *s++;
+    }
+    return p;
+}
+
+/* Append v to p in decimal, as microseconds if v is nanoseconds and
+ * micros is true, returning the new end. Tracing writes a lot of
+ * numbers, and printf is several times slower. */
+char *put_number(char *p, long long v, bool micros)
+{
+    char digits[24];
+    int n = 0;
+
+    if(v < 0) {
+        *p++ = '-';
+        v = -v;
+    }
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+        if(micros && n == 3) {
+            digits[n++] = '.';
+        }
+    } while(v > 0 || (micros && n < 5));
+    while(n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+/* Write out this thread's events and empty its buffer */
+void trace_flush(void)
+{
+    if(traceFd < 0 || traceCount == 0) {
+        return;
+    }
+
+    size_t size = 0;
+    for(int i = 0; i < traceCount; i++) {
+        size += 192 + 2 * strlen(traceEvents[i].name);
+    }
+    char *out = (char *)malloc(size), *p = out;
+    for(int i = 0; i < traceCount; i++) {
+        struct trace_event *e = &traceEvents[i];
+        p = put_string(p, "{\"name\":\"");
+        p = put_name(p, e->name);
+        p = put_string(p, e->phase == 'X' ? "\",\"ph\":\"X\",\"ts\":" :
+                "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":");
+        p = put_number(p, e->start, true);
+        if(e->phase == 'X') {
+            p = put_string(p, ",\"dur\":");
+            p = put_number(p, e->duration, true);
+        }
+        p = put_string(p, ",\"pid\":");
+        p = put_number(p, traceProcess, false);
+        p = put_string(p, ",\"tid\":");
+        p = put_number(p, traceTrack, false);
+        p = put_string(p, ",\"args\":{\"block\":");
+        p = put_number(p, e->block, false);
+        p = put_string(p, ",\"line\":");
+        p = put_number(p, e->line, false);
+        p = put_string(p, "}},\n");
+    }
+    write_all(traceFd, out, p - out);
+    free(out);
+    traceCount = 0;
+}
+
+/* Record a slice called name, from start until now, at the given block
+ * and line. Does nothing unless tracing. */
+void trace(const char *name, int block, int line, long long start)
+{
+    if(traceFd < 0) {
+        return;
+    }
+    if(traceEvents == NULL) {
+        traceEvents = (struct trace_event *)malloc(
+                sizeof(struct trace_event) * TRACE_EVENTS);
+    } else if(traceCount == TRACE_EVENTS) {
+        trace_flush();
+    }
+    struct trace_event *e = &traceEvents[traceCount++];
+    e->name = name;
+    e->phase = start < 0 ? 'i' : 'X';
+    e->block = block;
+    e->line = line;
+    e->duration = start < 0 ? 0 : now_ns() - start;
+    e->start = start < 0 ? now_ns() : start;
+}
+
+/* Record something that happened now at the current line */
+void trace_instant(const char *name)
+{
+    trace(name, blockCount, lineCount, -1);
+}
+
+/* Make a reader for the file descriptor fd */
+struct reader *new_reader(int fd)
+{
+    struct reader *r = (struct reader *)malloc(sizeof(struct reader));
+    r->fd = fd;
+    r->size = READ_LEN;
+    r->buffer = (char *)malloc(sizeof(char) * r->size);
+    r->start = r->end = 0;
+    r->eof = r->echo = r->crlf = false;
+    r->line = r->block = 1;
+    return r;
+}
+
+/* Point r at a new descriptor, dropping anything still buffered */
+void reader_reset(struct reader *r, int fd)
+{
+    r->fd = fd;
+    r->start = r->end = 0;
+    r->eof = false;
+}
+
+/* Make sure there is room for n more bytes after the end of the data */
+void reader_reserve(struct reader *r, size_t n)
+{
+    /* Move unconsumed bytes to the front before resorting to growing */
+    if(r->start > 0) {
+        memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    while(r->size - r->end < n) {
+        r->size *= 2;
+        r->buffer = (char *)realloc(r->buffer, sizeof(char) * r->size);
+    }
+}
+
+/* Copy up to n bytes waiting in the pipe fd to stdout without taking
+ * them out of the pipe, so whoever reads fd still gets them.
+ * Returns the number of bytes copied, 0 at end of file and -1 if
+ * stdout can't be fed this way and the bytes must be copied by hand */
+ssize_t echo_ahead(int fd, size_t n)
+{
+    ssize_t copied, moved;
+    struct stat buffer;
+
+    if(echoMode == ECHO_UNKNOWN) {
+        fstat(STDOUT_FILENO, &buffer);
+        if(S_ISFIFO(buffer.st_mode)) {
+            echoMode = ECHO_TEE;
+        } else if(pipe2(echoPipe, O_CLOEXEC) == 0) {
+            echoMode = ECHO_SPLICE;
+        } else {
+            echoMode = ECHO_COPY;
+        }
+    }
+    if(echoMode == ECHO_COPY) {
+        return -1;
+    }
+
+    /* Anything we've printf'd must come out first */
+    fflush(stdout);
+    do {
+        copied = tee(fd, echoMode == ECHO_TEE ? STDOUT_FILENO : echoPipe[1],
+                n, 0);
+    } while(copied < 0 && errno == EINTR);
+    if(copied <= 0 || echoMode == ECHO_TEE) {
+        return copied;
+    }
+
+    /* Move the copy from our own pipe on to stdout */
+    for(n = copied; n > 0; n -= moved) {
+        moved = splice(echoPipe[0], NULL, STDOUT_FILENO, NULL, n,
+                SPLICE_F_MOVE);
+        if(moved < 0 && errno == EINTR) {
+            moved = 0;
+        } else if(moved < 0) {
+            /* Stdout won't take a splice, hand over what's left */
+            char spare[READ_LEN];
+            while(n > 0 && (moved = read(echoPipe[0], spare, n)) > 0) {
+                write_all(STDOUT_FILENO, spare, moved);
+                n -= moved;
+            }
+            echoMode = ECHO_COPY;
+            break;
+        }
+    }
+    return copied;
+}
+
+/* Read whatever is available into the reader.
+ * Returns the number of bytes read, 0 at end of file, -1 on error */
+ssize_t reader_fill(struct reader *r)
+{
+    ssize_t n, copied = -1;
+    size_t got;
+
+    /* Wait through poll, so signals are seen while the other end is
+     * quiet, and give up at the running command's deadline */
+    struct pollfd ready = {r->fd, POLLIN, 0};
+    while(wait_for_events(&ready, 1, deadline_timeout()) == 0) {
+        if(deadline_passed()) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    if(r->end == r->size) {
+        reader_reserve(r, 1);
+    }
+    if(r->echo) {
+        copied = echo_ahead(r->fd, r->size - r->end);
+    }
+
+    if(copied >= 0) {
+        /* Take exactly what was echoed so nothing is shown twice */
+        for(got = 0; got < (size_t)copied; got += n) {
+            do {
+                n = read(r->fd, r->buffer + r->end + got, copied - got);
+            } while(n < 0 && errno == EINTR);
+            if(n <= 0) {
+                break;
+            }
+        }
+        n = got;
+    } else {
+        do {
+            n = read(r->fd, r->buffer + r->end, r->size - r->end);
+        } while(n < 0 && errno == EINTR);
+        if(r->echo && n > 0) {
+            fflush(stdout);
+            write_all(STDOUT_FILENO, r->buffer + r->end, n);
+        }
+    }
+
+    if(n > 0) {
+        r->end += n;
+    } else {
+        r->eof = true;  // Errors are treated like end of file
+    }
+    return n;
+}
+
+/* Return the next line without its newline, or NULL at end of file.
+ * The line lives in the reader's buffer and is only valid until the
+ * reader is used again. */
+char *reader_line(struct reader *r)
+{
+    char *line, *newline;
+
+    while(true) {
+        line = r->buffer + r->start;
+        newline = memchr(line, '\n', r->end - r->start);
+        if(newline != NULL) {
+            if(r->crlf && newline > line && newline[-1] == '\r') {
+                newline[-1] = '\0';
+            }
+            *newline = '\0';
+            r->start = newline - r->buffer + 1;
+            return line;
+        }
+        if(r->eof) {
+            break;
+        }
+        if(reader_fill(r) < 0 && errno == ETIMEDOUT) {
+            return NULL;    // What's there may yet be finished
+        }
+    }
+
+    /* Return NULL if we've reached EOF on a new line */
+    if(r->start == r->end) {
+        return NULL;
+    }
+    /* Reached EOF but there's stuff in the buffer */
+    reader_reserve(r, 1);
+    line = r->buffer + r->start;
+    r->buffer[r->end] = '\0';
+    r->start = r->end;
+    return line;
+}
+
 /* Separates space-delimited words into an argv array 
  * Assumes cmd is a null-terminated string and holds at least one arg */
 char **cmd_to_argv(char *cmd) 
@@ -87,7 +1041,6 @@ char **cmd_to_argv(char *cmd)
 
     char *token = strtok(dupCmd, " ");
     for(int i = 0; i < argc; i++) {
-        argv[i] = (char *)malloc(sizeof(char) * (strlen(token) + 1));
         argv[i] = token;
         token = strtok(NULL, " ");
     }
@@ -96,468 +1049,3489 @@ char **cmd_to_argv(char *cmd)
     return argv;    
 }
 
-/* Runs a the process given by cmd as a child */
-int run_new_process(char *cmd) 
+/* Search the PATH for name the way execvp would. Returns a copy of the
+ * path to the program or NULL if it isn't there */
+char *search_path(char *name)
 {
-    /* Command shouldn't start with a space */
-    if(*cmd == ' ') {
+    if(strchr(name, '/') != NULL) {
+        return strdup(name);
+    }
+
+    char *dirs = getenv("PATH");
+    if(dirs == NULL) {
+        dirs = "/bin:/usr/bin";
+    }
+    while(*dirs != '\0') {
+        size_t length = strcspn(dirs, ":");
+        char path[length + strlen(name) + 3];
+        struct stat buffer;
+
+        /* An empty PATH entry means the current directory */
+        sprintf(path, "%.*s/%s", (int)length, length ? dirs : ".", name);
+        if(!stat(path, &buffer) && S_ISREG(buffer.st_mode) &&
+                !access(path, X_OK)) {
+            return strdup(path);
+        }
+        dirs += length + (dirs[length] == ':');
+    }
+    return NULL;
+}
+
+/* Open prog's path and note what it looked like. Returns -1 if it can't */
+int open_program(struct program *prog)
+{
+    struct stat buffer;
+
+    prog->fd = open(prog->path, O_PATH | O_CLOEXEC);
+    if(prog->fd < 0 || fstat(prog->fd, &buffer)) {
         return -1;
     }
-    char **argv = cmd_to_argv(cmd);
-    
-    /* Create the pipes */
-    if(pipe(pRead) < 0 || pipe(pWrite) < 0) {
-        perror("pipe failed");
-        exit(errno);
+    prog->dev = buffer.st_dev;
+    prog->ino = buffer.st_ino;
+    prog->mtime = buffer.st_mtim;
+    return 0;
+}
+
+/* Whether the file at prog's path is no longer the one that was opened */
+bool program_changed(struct program *prog)
+{
+    struct stat buffer;
+
+    return stat(prog->path, &buffer) || buffer.st_dev != prog->dev ||
+            buffer.st_ino != prog->ino ||
+            buffer.st_mtim.tv_sec != prog->mtime.tv_sec ||
+            buffer.st_mtim.tv_nsec != prog->mtime.tv_nsec;
+}
+
+/* Return the cached program for name, finding it the first time it is
+ * asked for. Returns NULL if it can't be found, leaving execvp to fail */
+struct program *find_program(char *name)
+{
+    struct program *prog;
+
+    for(prog = programs; prog != NULL; prog = prog->next) {
+        if(strcmp(prog->name, name) == 0) {
+            break;
+        }
     }
 
-    /* Create a process space for program to be executed */
-    if((pid = fork()) < 0) {
-        perror("Fork failed");
-        exit(errno);
+    if(prog != NULL && program_changed(prog)) {
+        fprintf(stderr, "Program %s changed during the run.\n", prog->path);
+        close(prog->fd);
+        if(open_program(prog)) {
+            return NULL;
+        }
+    }
+    if(prog != NULL) {
+        return prog;
     }
 
-    /* Child process */
-    if(!pid) {
-        close(pWrite[1]);
-        close(pRead[0]);
+    char *path = search_path(name);
+    if(path == NULL) {
+        return NULL;
+    }
+    prog = (struct program *)malloc(sizeof(struct program));
+    prog->name = strdup(name);
+    prog->path = path;
+    if(open_program(prog)) {
+        free(prog->name);
+        free(prog->path);
+        free(prog);
+        return NULL;
+    }
 
-        dup2(pWrite[0], 0); // 0 is stdin
-        dup2(pRead[1], 1);  // 1 is stdout
+    /* Have the program read in while we're busy with other things */
+    int fd = open(prog->path, O_RDONLY | O_CLOEXEC);
+    if(fd >= 0) {
+        readahead(fd, 0, READ_LEN * 16);
+        close(fd);
+    }
+    prog->next = programs;
+    programs = prog;
+    return prog;
+}
 
-        close(pWrite[0]);
-        close(pRead[1]);
-    
-        execvp(argv[0], argv);
-        
-        /* Only get here if execvp failed */
-        pid_t ppid = getppid();
-        kill(ppid, SIGUSR1);
+/* Add the resources one reaped process used to total */
+void add_usage(struct rusage *total, struct rusage *used)
+{
+    timeradd(&total->ru_utime, &used->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &used->ru_stime, &total->ru_stime);
+    if(used->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = used->ru_maxrss;
     }
+    total->ru_minflt += used->ru_minflt;
+    total->ru_majflt += used->ru_majflt;
+    total->ru_nvcsw += used->ru_nvcsw;
+    total->ru_nivcsw += used->ru_nivcsw;
+}
 
-    /* Parent process */
-    if(pid) {
-        free(argv);     //Don't need to use this here so clean it up
-        close(pWrite[0]);
-        close(pRead[1]);
-        readPipe = fdopen(pRead[0], "r");
-        writePipe = fdopen(pWrite[1], "w");
+/* Reap p, or any of our children in process group -p, if it has exited,
+ * adding what it used to the block's total. Returns the pid reaped, 0
+ * if nothing was ready */
+pid_t reap(pid_t p)
+{
+    struct rusage used;
+    pid_t reaped;
 
+    while((reaped = wait4(p, NULL, WNOHANG, &used)) < 0 && errno == EINTR) {
+        /* Retry */
+    }
+    if(reaped <= 0) {
         return 0;
     }
-    return 0;
+    add_usage(&blockUsage, &used);
+    return reaped;
+}
+
+/* Whether the process group led by leader is empty. Reaps the leader,
+ * unless reaped says it already has been, and any orphans of the group
+ * handed to us, as they exit */
+bool group_gone(pid_t leader, bool *reaped)
+{
+    pid_t p;
+
+    while((p = reap(-leader)) > 0) {
+        if(p == leader) {
+            *reaped = true;
+        } else {
+            orphans++;
+        }
+    }
+    return *reaped && kill(-leader, 0) < 0 && errno == ESRCH;
+}
+
+/* Fill found with up to n of our children other than the prepared
+ * child. Everything else we have was left behind by the block being
+ * cleaned up. Returns how many were found */
+int find_orphans(pid_t *found, int n)
+{
+    int count = 0;
+    DIR *tasks = opendir("/proc/self/task");
+    struct dirent *task;
+
+    while(tasks != NULL && count < n && (task = readdir(tasks)) != NULL) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%.16s/children",
+                task->d_name);
+        FILE *children = fopen(path, "r");
+        int p;
+        while(children != NULL && count < n &&
+                fscanf(children, "%d", &p) == 1) {
+            if(p != prepared.pid) {
+                found[count++] = p;
+            }
+        }
+        if(children != NULL) {
+            fclose(children);
+        }
+    }
+    if(tasks != NULL) {
+        closedir(tasks);
+    }
+    return count;
+}
+
+/* Take down and reap everything the block started that outlived its
+ * parent and was handed to us, escalating through killSignals with
+ * killGrace milliseconds between them like terminate_group. Killing
+ * one orphan can orphan more, so keep going until none are left. */
+void reap_orphans(void)
+{
+    pid_t found[256];
+    int n, step = 0;
+
+    while((n = find_orphans(found, 256)) > 0) {
+        int left = 0;
+        for(int i = 0; i < n; i++) {
+            if(reap(found[i]) == found[i]) {
+                orphans++;
+            } else {
+                found[left++] = found[i];
+            }
+        }
+        if(left < n) {
+            continue;   // Look again, their children may be ours now
+        }
+
+        for(int i = 0; i < left; i++) {
+            kill(found[i], killSignals[step]);
+            kill(-found[i], killSignals[step]); // In case it leads a group
+        }
+        long long deadline = now_ns() + killGrace * 1000000LL;
+        while(left > 0 && now_ns() < deadline) {
+            wait_for_events(NULL, 0, 1);
+            for(int i = 0; i < left; i++) {
+                if(reap(found[i]) == found[i]) {
+                    orphans++;
+                    found[i--] = found[--left];
+                }
+            }
+        }
+        step = step < 2 ? step + 1 : step;
+    }
+}
+
+/* Take down the process group led by one of our children: SIGINT, then
+ * SIGTERM, then SIGKILL, giving the group killGrace milliseconds after
+ * each to go. The leader is always reaped, unless reaped says it already
+ * has been. Members that aren't our children are checked on every
+ * millisecond until the deadline. */
+void terminate_group(pid_t leader, bool reaped)
+{
+    int pidfd = reaped ? -1 : syscall(SYS_pidfd_open, leader, 0);
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec deadline = {{0, 0},
+            {killGrace / 1000, killGrace % 1000 * 1000000L}};
+
+    for(int i = 0; i < 3 && !group_gone(leader, &reaped); i++) {
+        kill(-leader, killSignals[i]);
+        trace_instant(killNames[i]);
+        timerfd_settime(timer, 0, &deadline, NULL);
+
+        while(!group_gone(leader, &reaped)) {
+            struct pollfd fds[2] = {{timer, POLLIN, 0},
+                    {reaped ? -1 : pidfd, POLLIN, 0}};
+            wait_for_events(fds, 2, reaped || pidfd < 0 ? 1 : -1);
+            if(fds[0].revents) {
+                break;      // Out of time, on to the next signal
+            }
+        }
+    }
+    if(!reaped) {
+        struct rusage used;
+        while(wait4(leader, NULL, 0, &used) < 0 && errno == EINTR) {
+            /* SIGKILL has been sent, it can't be long */
+        }
+        add_usage(&blockUsage, &used);
+    }
+
+    close(timer);
+    if(pidfd >= 0) {
+        close(pidfd);
+    }
+}
+
+/* Open counter i on process p and everything it starts, to begin
+ * counting when p execs. Kernel counting isn't always allowed, so fall
+ * back to counting user space only. Returns -1 if it can't be had. */
+int open_counter(pid_t p, int i)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counterTypes[i].type;
+    attr.config = counterTypes[i].config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    fd = syscall(SYS_perf_event_open, &attr, p, -1, -1,
+            PERF_FLAG_FD_CLOEXEC);
+    if(fd < 0 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, p, -1, -1,
+                PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+/* Read counter i of the block's program, scaled up for any time it had
+ * to share the hardware. Counts from children are only added as they
+ * exit. Returns false if the counter isn't available */
+bool read_counter(int i, unsigned long long *value)
+{
+    unsigned long long data[3];     // Count, time enabled, time running
+
+    if(counters[i] < 0 ||
+            read(counters[i], data, sizeof(data)) != sizeof(data) ||
+            data[2] == 0) {
+        return false;
+    }
+    *value = data[2] < data[1] ?
+            (unsigned long long)((double)data[0] * data[1] / data[2]) :
+            data[0];
+    return true;
+}
+
+/* Read the counters on the block's program into counterValues,
+ * printing the ones that are available if report says to, then close
+ * them all */
+void finish_counters(int block, bool report)
+{
+    bool any = false;
+
+    for(int i = 0; i < COUNTERS; i++) {
+        counted[i] = read_counter(i, &counterValues[i]);
+        if(report && counted[i]) {
+            if(!any) {
+                printf("Block %d:", block);
+            }
+            printf("%s %s %llu", any ? "," : "", counterTypes[i].name,
+                    counterValues[i]);
+            any = true;
+        }
+        if(counters[i] >= 0) {
+            close(counters[i]);
+            counters[i] = -1;
+        }
+    }
+    if(any) {
+        printf("\n");
+    }
+}
+
+/* Open a pseudo-terminal to stand in for the pipe from a child, filling
+ * in fds as pipe would. Seeing a terminal, the C library flushes each
+ * line as it's printed rather than every 4KB. It's put in raw mode so
+ * nothing is echoed and newlines aren't turned into \r\n. */
+int open_pty(int fds[2])
+{
+    struct termios raw;
+    char name[64];
+
+    fds[0] = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(fds[0] < 0) {
+        return -1;
+    }
+    if(grantpt(fds[0]) || unlockpt(fds[0]) ||
+            ptsname_r(fds[0], name, sizeof(name)) ||
+            (fds[1] = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    tcgetattr(fds[1], &raw);
+    cfmakeraw(&raw);
+    tcsetattr(fds[1], TCSANOW, &raw);
+    return 0;
+}
+
+/* Start the program of block b as a child, filling in c. If hold is
+ * true the child waits to exec until adopt_child lets it go. If the
+ * block is counted it's held anyway, so performance counters can be
+ * opened on it before it execs.
+ * Returns -1 if the program line isn't valid */
+int spawn_child(struct block *b, struct child *c, bool hold)
+{
+    int pRead[2] = {-1, -1};    // Pipe or pseudo-terminal for reading
+    int pWrite[2] = {-1, -1};   // Pipe for writing
+    int pStatus[2];         // Pipe for checking whether exec succeeded
+    int pGo[2] = {-1, -1};  // Pipe for holding the child back
+    int null = -1;          // Stands in for what the block doesn't use
+    bool count = count_block(b);
+
+    /* Command shouldn't start with a space */
+    if(*b->program == ' ') {
+        return -1;
+    }
+    char **argv = cmd_to_argv(b->program);
+    struct program *prog = find_program(argv[0]);
+    hold = hold || count;
+
+    /* Create the pipes, unless nothing would go through them. Our ends
+     * mustn't leak into later children */
+    if((!b->wants || !b->sends) &&
+            (null = open("/dev/null", O_RDWR | O_CLOEXEC)) < 0) {
+        perror("open /dev/null failed");
+        exit(errno);
+    }
+    if(!b->wants) {
+        pRead[1] = null;
+    } else if((b->pty ? open_pty(pRead) : pipe2(pRead, O_CLOEXEC)) < 0) {
+        perror("pipe failed");
+        exit(errno);
+    }
+    if(!b->sends) {
+        pWrite[0] = null;
+    } else if(pipe2(pWrite, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        exit(errno);
+    }
+
+    /* Give the pipes more room, so a child streaming output keeps going
+     * while we're busy elsewhere. Past /proc/sys/fs/pipe-max-size it
+     * takes privilege, and a pipe that can't grow is left as it is */
+    int size = b->pipeSize > 0 ? b->pipeSize : pipeSize;
+    if(size > 0) {
+        if(b->wants && !b->pty) {
+            fcntl(pRead[0], F_SETPIPE_SZ, size);
+        }
+        if(b->sends) {
+            fcntl(pWrite[1], F_SETPIPE_SZ, size);
+        }
+    }
+    if(pipe2(pStatus, O_CLOEXEC) < 0 ||
+            (hold && pipe2(pGo, O_CLOEXEC) < 0)) {
+        perror("pipe failed");
+        exit(errno);
+    }
+
+    /* Create a process space for program to be executed */
+    if((c->pid = fork()) < 0) {
+        perror("Fork failed");
+        exit(errno);
+    }
+
+    /* Child process, in a process group of its own so anything it
+     * starts can be taken down with it */
+    if(!c->pid) {
+        setpgid(0, 0);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);  // Exec keeps the mask
+        signal(SIGPIPE, SIG_DFL);               // And ignored signals
+        dup2(pWrite[0], 0); // 0 is stdin
+        dup2(pRead[1], 1);  // 1 is stdout
+
+        /* Wait until our end of the go pipe is closed */
+        char go;
+        if(hold) {
+            close(pGo[1]);
+            while(read(pGo[0], &go, 1) < 0 && errno == EINTR) {
+                /* Retry */
+            }
+        }
+
+        if(prog != NULL) {
+            syscall(SYS_execveat, prog->fd, "", argv, environ,
+                    AT_EMPTY_PATH);
+            /* Scripts can't be run through a close-on-exec descriptor */
+            execv(prog->path, argv);
+        } else {
+            execvp(argv[0], argv);
+        }
+        
+        /* Only get here if exec failed */
+        int error = errno;
+        write_all(pStatus[1], (char *)&error, sizeof(error));
+        _exit(127);
+    }
+
+    /* Parent process, which sets the group too in case it gets to
+     * signal the group before the child has */
+    setpgid(c->pid, c->pid);
+    free(argv[0]);  //Don't need to use this here so clean it up
+    free(argv);
+    if(pWrite[0] != null) {
+        close(pWrite[0]);
+    }
+    if(pRead[1] != null) {
+        close(pRead[1]);
+    }
+    if(null != -1) {
+        close(null);
+    }
+    close(pStatus[1]);
+    if(hold) {
+        close(pGo[0]);
+    }
+    for(int i = 0; i < COUNTERS; i++) {
+        c->counters[i] = count ? open_counter(c->pid, i) : -1;
+    }
+    c->in = pWrite[1];
+    c->out = pRead[0];
+    c->pty = b->pty;
+    c->status = pStatus[0];
+    c->go = pGo[1];
+    return 0;
+}
+
+/* Make c the child the commands talk to.
+ * Returns -1 if its program couldn't be run */
+int adopt_child(struct child *c)
+{
+    int error;
+    ssize_t n;
+
+    if(c->go != -1) {
+        close(c->go);   // Let it exec
+        c->go = -1;
+    }
+
+    /* Nothing comes down the status pipe unless exec failed */
+    struct pollfd ready = {c->status, POLLIN, 0};
+    while(wait_for_events(&ready, 1, -1) == 0) {
+        /* Only a signal */
+    }
+    do {
+        n = read(c->status, &error, sizeof(error));
+    } while(n < 0 && errno == EINTR);
+    close(c->status);
+
+    pid = c->pid;
+    reader_reset(childOut, c->out);
+    childOut->crlf = c->pty;
+    childIn = c->in;
+    if(childIn != -1) {
+        fcntl(childIn, F_SETFL, fcntl(childIn, F_GETFL) | O_NONBLOCK);
+    }
+    memcpy(counters, c->counters, sizeof(counters));
+    c->pid = -1;
+    return n > 0 ? -1 : 0;
+}
+
+/* Write all of iov to the child's stdin, waiting through poll whenever
+ * its pipe is full. While it waits, whatever the child writes is read
+ * into childOut for later wants, so a child blocked on a full stdout
+ * can't leave both sides waiting for the other.
+ * Returns -1 on error, EPIPE if the child has closed its end or
+ * ETIMEDOUT if commandDeadline passed first */
+int write_child(struct iovec *iov, int count)
+{
+    while(count > 0) {
+        ssize_t n = writev(childIn, iov, count);
+        if(n < 0) {
+            if(errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+            struct pollfd ready[2] = {
+                {childIn, POLLOUT, 0},
+                {childOut->eof ? -1 : childOut->fd, POLLIN, 0}
+            };
+            if(wait_for_events(ready, 2, deadline_timeout()) == 0 &&
+                    deadline_passed()) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if(ready[1].revents != 0) {
+                childOut->echo = echo;
+                reader_fill(childOut);  // Won't wait, it's ready
+            }
+            continue;
+        }
+        for(; count > 0 && (size_t)n >= iov->iov_len; iov++, count--) {
+            n -= iov->iov_len;
+        }
+        if(count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Runs the program of block b as a child */
+int run_new_process(struct block *b)
+{
+    struct child c;
+
+    if(spawn_child(b, &c, false)) {
+        return -1;
+    }
+    return adopt_child(&c);
+}
+
+/* Get the source of input
+ * If no file is specified, stdin is used */
+int get_input_source(char *file) 
+{
+    if(file == NULL) {
+        return STDIN_FILENO;
+    }
+
+    int input = open(file, O_RDONLY | O_CLOEXEC);
+    if(input < 0) {
+        throw_error(ERR_OPEN, 0, file);
+    }
+    return input;
+}
+
+/* Return true if block has ended, false if not */
+bool block_end(char *line) 
+{
+    return !strcmp(line, "");
+}
+
+/* Command Handlers */
+/* Each handler is given its arguments already checked against the
+ * command's schema. */
+
+/* Wait for the child process to exit. Pass if exit status is n.
+ * Fail if program exists abnormally or exit status does not equal n.
+ * Fail if n is not a positive (including 0) integer*/
+int handle_exit(int n)
+{
+    /* Only one exit per block. */
+    if(sawExit) {
+        return -1;
+    }
+    sawExit = true;
+
+    /* Wait for the child process to exit and handle appropriately.
+     * SIGCHLD wakes us to look again. */
+    struct rusage used;
+    pid_t reaped;
+    while((reaped = wait4(pid, &childStatus, WNOHANG, &used)) == 0) {
+        wait_for_events(NULL, 0, -1);
+    }
+    if(reaped < 0) {
+        return -1;
+    }
+    add_usage(&blockUsage, &used);
+    childUsage = used;
+    if(WIFEXITED(childStatus)) {
+        if(childStatus >> 8 == n) {
+            return 1;
+        }
+    }
+
+    return -1;
+}
+
+/* Read a line of text from the child process
+ * Pass if it maches text. Fail if not, or if the line hasn't all
+ * arrived within limit nanoseconds when limit isn't 0. */
+int handle_want(char *text, long long limit)
+{
+    childOut->echo = echo;
+    commandDeadline = limit > 0 ? now_ns() + limit : 0;
+    char *line = reader_line(childOut);
+    commandDeadline = 0;
+    if(line == NULL || strcmp(line, text) != 0) {
+        return -1;
+    }
+
+    return 2;
+}
+
+/* Send text to the input of the child process
+ * Pass provided there is no IO error and endinput has not been
+ * executed, and when limit isn't 0, the child takes it all within
+ * limit nanoseconds */
+int handle_send(char *text, long long limit)
+{
+    if(childIn == -1) {
+        return -1;
+    }
+
+    struct iovec line[2] = {{text, strlen(text)}, {"\n", 1}};
+    commandDeadline = limit > 0 ? now_ns() + limit : 0;
+    int written = write_child(line, 2);
+    commandDeadline = 0;
+    if(written < 0) {
+        return -1;
+    }
+
+    return 3;
+}
+
+/* Passes if the file indicated by path exists */
+int handle_exists(char *path)
+{
+    /* Check accessability of the file. F_OK checks existence */
+    int error = access(path, F_OK);
+    if(error) {
+        return -1;
+    }
+
+    return 4;
+}
+
+/* Pass if the file indicated by path exists and has size bigger than n.
+ * Fail otherwise. */
+int handle_size(int n, char *path)
+{
+    /* Check the file size */
+    struct stat buffer;
+    if(stat(path, &buffer) || buffer.st_size <= n) {
+        return -1;
+    }
+
+    return 5;
+}
+
+/* When output is read from the child process, it should be 
+ * copied to stdout. The parameter determines whether echo is off or on
+ * By default, echo should be off. Passes if given correct param.
+ * Output is echoed as want pulls it off the pipe, so a line read ahead
+ * while echo is on is shown even if echo is off by the time it's
+ * wanted. */
+int handle_echo(char *state)
+{
+    /* Echo takes a string paramter which must be either "on" or
+     * "off" */
+    if(strcmp(state, "on") && strcmp(state, "off")) {
+        return -1;
+    }   
+
+    if(strcmp(state, "on") == 0) {
+        echo = true;    
+    } else {            // Only one or the other because of above
+        echo = false;
+    }
+
+    return 6;
+}
+
+/* No more input will be sent to the program. Close the input pipe.
+ * Always passes. */
+int handle_endinput(void) 
+{
+    if(childIn != -1) {
+        close(childIn);
+        childIn = -1;
+    }
+    return 7;
+}
+
+/* Wait for one of fds to become ready, acting on any signals that
+ * arrive in the meantime. Every wait goes through here so a limit
+ * running out is seen wherever we're stuck. Returns the number of fds
+ * ready, 0 on timeout or if only a signal came */
+int wait_for_events(struct pollfd *fds, nfds_t n, int timeout)
+{
+    struct pollfd all[n + 1];
+    int ready;
+
+    if(n > 0) {
+        memcpy(all, fds, n * sizeof(struct pollfd));
+    }
+    all[n].fd = signals;
+    all[n].events = POLLIN;
+    while((ready = poll(all, n + 1, timeout)) < 0) {
+        if(errno != EINTR) {
+            perror("poll failed");
+            exit(errno);
+        }
+    }
+    for(nfds_t i = 0; i < n; i++) {
+        fds[i].revents = all[i].revents;
+    }
+    if(all[n].revents) {
+        ready--;
+        handle_signals();
+    }
+    return ready;
+}
+
+/* Copy whatever the child has written so far to our stdout, splicing
+ * it across when stdout allows. Returns 0 once the child closes its
+ * output, -1 on error */
+ssize_t proxy_output(int fd)
+{
+    static bool canSplice = true;   // Not all stdouts support splice
+    char buffer[READ_LEN];
+    ssize_t n;
+
+    if(canSplice) {
+        n = splice(fd, NULL, STDOUT_FILENO, NULL, READ_LEN, SPLICE_F_MOVE);
+        if(n >= 0 || errno != EINVAL) {
+            return (n < 0 && errno == EINTR) ? 1 : n;
+        }
+        canSplice = false;
+    }
+
+    do {
+        n = read(fd, buffer, sizeof(buffer));
+    } while(n < 0 && errno == EINTR);
+    if(n > 0 && write_all(STDOUT_FILENO, buffer, n) < 0) {
+        return -1;
+    }
+    return n;
+}
+
+/* Read lines of input and send them to the program.
+ * Stop doing this when W as indicated in params, appears on its own.
+ * Passes provided the send operations succeed.
+ * If W contains spaces, then only chars before the space will be used.
+ * Interactive input is always read from stdin.
+ * Until W is read, output from the program is passed straight through
+ * to stdout so a chatty program can't fill its pipe and stall. From
+ * then on it's left for want, while any lines still to go are sent. */
+int handle_interactive(char *interactive, char *input)
+{
+    if(childIn == -1) {
+        return -1;
+    }
+    size_t wordLength = strlen(interactive);
+
+    /* Anything already printed must come before the program's output */
+    fflush(stdout);
+
+    /* Input may already have been taken from the script */
+    struct reader *in = terminal;
+    if(input != NULL) {
+        in = new_reader(-1);
+        reader_reserve(in, strlen(input));
+        in->end = strlen(input);
+        memcpy(in->buffer, input, in->end);
+        in->eof = true;
+    }
+
+    size_t pending = 0;     // Checked bytes at the front of in to send
+    size_t wordEnd = 0;     // Length of the terminator line once found
+    bool done = false;      // Whether the terminator or EOF was seen
+    bool childDone = false; // Whether the child closed its output
+    int result = 8;
+
+    while(!done) {
+        /* Lines which aren't the terminator can be sent on */
+        while(!done) {
+            char *line = in->buffer + in->start + pending;
+            size_t left = in->end - in->start - pending;
+            char *newline = memchr(line, '\n', left);
+            size_t length = newline != NULL ? newline - line : left;
+
+            if(newline == NULL && !in->eof) {
+                break;
+            }
+            if(newline == NULL && length == 0) {
+                done = true;
+            } else if(length == wordLength &&
+                    !strncmp(line, interactive, length)) {
+                done = true;
+                wordEnd = newline != NULL ? length + 1 : length;
+            } else if(newline == NULL) {
+                /* Last line of input has no newline, give it one */
+                reader_reserve(in, 1);
+                in->buffer[in->end++] = '\n';
+            } else {
+                pending += length + 1;
+            }
+        }
+        if(done) {
+            break;
+        }
+
+        /* Only poll what there's a use for, as errors and hangups are
+         * reported whatever the events asked for */
+        struct pollfd fds[3] = {
+            {in->eof ? -1 : in->fd, POLLIN, 0},
+            {pending > 0 ? childIn : -1, POLLOUT, 0},
+            {childDone ? -1 : childOut->fd, POLLIN, 0}
+        };
+        wait_for_events(fds, 3, -1);
+
+        if(fds[2].revents) {
+            ssize_t n = proxy_output(childOut->fd);
+            if(n < 0) {
+                result = -1;
+                break;
+            }
+            childDone = n == 0;
+        }
+        if(fds[1].revents & (POLLERR | POLLHUP)) {
+            result = -1;    // The child has closed its input
+            break;
+        }
+        if(fds[1].revents) {
+            ssize_t n = write(childIn, in->buffer + in->start, pending);
+            if(n < 0 && errno != EAGAIN && errno != EINTR) {
+                result = -1;
+                break;
+            }
+            if(n > 0) {
+                in->start += n;
+                pending -= n;
+            }
+        }
+        if(fds[0].revents) {
+            reader_fill(in);
+        }
+    }
+
+    /* Send what's left, keeping what the program prints for want */
+    struct iovec rest = {in->buffer + in->start, pending};
+    if(result != -1 && pending > 0 && write_child(&rest, 1) < 0) {
+        result = -1;
+    }
+    in->start += pending + wordEnd; // Consume the terminator too
+
+    if(in != terminal) {
+        free(in->buffer);
+        free(in);
+    }
+    return result;
+}
+
+/* Starts a timer. If a block has not been completed before the timer runs 
+ * out then finish the block, kill the program and print an error message */
+int handle_limit(int n)
+{
+    /* there can only be one limit per block */
+    if(sawLimit) {
+        return -1;
+    }
+    alarm(n);
+    trace_instant("limit");
+
+    sawLimit = true;
+    return 9;
+}
+
+/* Run n copies of the block at once. Fail if n is not a non-zero
+ * positive integer */
+int handle_instances(int n)
+{
+    if(n < 1) {
+        return -1;
+    }
+    return 12;
+}
+
+/* Look up a command word of the given length, NULL if there's no such
+ * command */
+const struct command *find_command(const char *word, size_t length)
+{
+    if(length < 3) {
+        return NULL;
+    }
+
+    const struct command *c = &commands[COMMAND_HASH((unsigned char)word[0],
+            (unsigned char)word[2], (unsigned char)word[length - 1],
+            length)];
+    if(c->name == NULL || strcmp(c->name, word) != 0) {
+        return NULL;
+    }
+    return c;
+}
+
+#ifdef CHECK_COMMANDS
+/* Hash name as COMMAND_HASH does, with the multipliers in m */
+int command_slot(const char *name, const int m[3])
+{
+    size_t length = strlen(name);
+    return ((unsigned char)name[0] * m[0] +
+            (unsigned char)name[2] * m[1] +
+            (unsigned char)name[length - 1] * m[2] + length) &
+            (COMMAND_SLOTS - 1);
+}
+
+/* Make sure every command is in the slot its name hashes to, and each
+ * command id has exactly one, as otherwise a command would silently
+ * fail to be found. If not, search for multipliers which would give
+ * every command its own slot and print them with the table to paste
+ * in. Says whether the table is right. */
+bool check_commands(void)
+{
+    const char *names[COMMAND_SLOTS];
+    int count = 0;
+    int seen[CMD_LAST + 1] = {0};
+    bool fits = true;
+
+    for(int i = 0; i < COMMAND_SLOTS; i++) {
+        const struct command *c = &commands[i];
+        if(c->name == NULL) {
+            continue;
+        }
+        names[count++] = c->name;
+        if(c->id >= 1 && c->id <= CMD_LAST) {
+            seen[c->id]++;
+        }
+        if(find_command(c->name, strlen(c->name)) != c) {
+            fprintf(stderr, "Command %s isn't in its slot\n", c->name);
+            fits = false;
+        }
+    }
+    for(int id = 1; id <= CMD_LAST; id++) {
+        if(seen[id] != 1) {
+            fprintf(stderr, "Command %d has %d slots\n", id, seen[id]);
+            fits = false;
+        }
+    }
+    if(fits) {
+        return true;
+    }
+
+    int m[3];
+    for(m[0] = 1; m[0] < COMMAND_SLOTS; m[0]++) {
+        for(m[1] = 1; m[1] < COMMAND_SLOTS; m[1]++) {
+            for(m[2] = 1; m[2] < COMMAND_SLOTS; m[2]++) {
+                uint64_t used = 0;
+                int i;
+                for(i = 0; i < count; i++) {
+                    uint64_t slot = 1ULL << command_slot(names[i], m);
+                    if(used & slot) {
+                        break;
+                    }
+                    used |= slot;
+                }
+                if(i < count) {
+                    continue;
+                }
+                fprintf(stderr, "Multipliers %d, %d and %d fit:\n",
+                        m[0], m[1], m[2]);
+                for(i = 0; i < count; i++) {
+                    fprintf(stderr, "    [%d] %s\n",
+                            command_slot(names[i], m), names[i]);
+                }
+                return false;
+            }
+        }
+    }
+    fprintf(stderr, "No multipliers fit, try more slots\n");
+    return false;
+}
+
+/* make builds this on its own and runs it before building suspect */
+int main(void)
+{
+    return check_commands() ? 0 : 1;
+}
+#endif
+
+/* Pass if the block's latest send to want exchange took less than limit
+ * nanoseconds or, given a percentile, if that percentile of all its
+ * exchanges so far did. Fails if there haven't been any. */
+int handle_latency(double percentile, long long limit)
+{
+    if(exchangeLatency.total == 0) {
+        return -1;
+    }
+    long long took = percentile > 0 ?
+            (long long)histogram_percentile(&exchangeLatency, percentile) :
+            lastExchange;
+    return took < limit ? 13 : -1;
+}
+
+/* Pass if what the program used, as wait4 reported when exit reaped it,
+ * is under limit. command says what is checked: peak resident set in
+ * kilobytes, user or system CPU time in nanoseconds, major page faults,
+ * or voluntary or involuntary context switches. Fails before exit. */
+int handle_usage(int command, long long limit)
+{
+    struct timeval *time = command == CMD_UTIME ?
+            &childUsage.ru_utime : &childUsage.ru_stime;
+    long long used;
+
+    if(!sawExit) {
+        return -1;
+    }
+    switch(command) {
+        case CMD_MAXRSS:
+            used = childUsage.ru_maxrss;
+            break;
+        case CMD_MAJFLT:
+            used = childUsage.ru_majflt;
+            break;
+        case CMD_NVCSW:
+            used = childUsage.ru_nvcsw;
+            break;
+        case CMD_NIVCSW:
+            used = childUsage.ru_nivcsw;
+            break;
+        default:
+            used = timeval_ns(time);
+    }
+    return used < limit ? command : -1;
+}
+
+/* Pass if counter i of the program has counted less than limit so
+ * far, which for task-clock is in nanoseconds. A counter that isn't
+ * available here isn't checked, only warned about, so scripts still
+ * run where they can't be had. */
+int handle_counter(int i, long long limit)
+{
+    unsigned long long value;
+
+    if(!read_counter(i, &value)) {
+        fprintf(stderr, "Counter %s unavailable, line %d not checked.\n",
+                counterTypes[i].name, lineCount);
+        return 20;
+    }
+    return value < (unsigned long long)limit ? 20 : -1;
+}
+
+/* Which of counterTypes is called name, -1 if none */
+int find_counter(const char *name)
+{
+    for(int i = 0; i < COUNTERS; i++) {
+        if(!strcmp(counterTypes[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Parse a duration such as 50us, 200ms or 2s into nanoseconds.
+ * Returns 0 if s isn't a positive duration */
+long long parse_duration(const char *s)
+{
+    long long n;
+    int used = 0;
+
+    if(sscanf(s, "%lld%n", &n, &used) != 1 || n <= 0) {
+        return 0;
+    }
+    if(!strcmp(s + used, "us")) {
+        return n * 1000;
+    } else if(!strcmp(s + used, "ms")) {
+        return n * 1000000;
+    } else if(!strcmp(s + used, "s")) {
+        return n * 1000000000;
+    }
+    return 0;
+}
+
+/* Parse the n characters of a percentile, such as the 99 of p99, into
+ * a fraction. They're a percentage, so p5 is 0.05, and may have a
+ * decimal point, as in p99.5. Three or more nines are shorthand for
+ * 99.9 and on, p999 being 0.999. Returns 0 if they aren't a
+ * percentile from above 0 up to 100 */
+double parse_percentile(const char *digits, size_t n)
+{
+    double percent = 0, scale = 0;  // scale is 0 until the point
+    size_t nines = 0;
+
+    for(size_t i = 0; i < n; i++) {
+        if(digits[i] == '.' && scale == 0) {
+            scale = 0.1;
+            continue;
+        }
+        if(digits[i] < '0' || digits[i] > '9') {
+            return 0;
+        }
+        nines += digits[i] == '9';
+        if(scale == 0) {
+            percent = percent * 10 + (digits[i] - '0');
+        } else {
+            percent += (digits[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+    if(scale == 0 && n > 2 && nines == n) {
+        return 1 - pow(10, -(double)n);
+    }
+    return percent > 0 && percent <= 100 ? percent / 100 : 0;
+}
+
+/* Check params against the schema of ins and pull out its arguments.
+ * Returns false if they don't fit. */
+bool parse_args(struct instruction *ins, char *params)
+{
+    char delimiter = '\0';  // Must be space or '\0' after a number
+
+    switch(ins->args) {
+        case ARGS_NONE:
+            return true;
+        case ARGS_TEXT:
+            ins->word = params;
+            return params != NULL;
+        case ARGS_WORD:
+            ins->word = ins->wordSpace;
+            return params != NULL && sscanf(params, "%s", ins->word) == 1;
+        case ARGS_NUMBER:
+        case ARGS_COUNT:
+            if(params == NULL ||
+                    sscanf(params, "%d%c", &ins->number, &delimiter) < 1) {
+                return false;
+            }
+            return (delimiter == ' ' || delimiter == '\0') &&
+                    (ins->args == ARGS_NUMBER || ins->number >= 0);
+        case ARGS_SIZE:
+            ins->word = ins->wordSpace;
+            return params != NULL &&
+                    sscanf(params, "%d %s", &ins->number, ins->word) == 2;
+        case ARGS_LATENCY:
+            if(params == NULL) {
+                return false;
+            }
+            ins->percentile = 0;
+            if(*params == 'p') {
+                char *space = strchr(params, ' ');
+                if(space == NULL || (ins->percentile =
+                        parse_percentile(params + 1, space - params - 1))
+                        == 0) {
+                    return false;
+                }
+                params = space + 1;
+            }
+            return (ins->value = parse_duration(params)) > 0;
+        case ARGS_DURATION:
+            return params != NULL &&
+                    (ins->value = parse_duration(params)) > 0;
+        case ARGS_COUNTER:
+            ins->word = ins->wordSpace;
+            if(params == NULL || sscanf(params, "%s %lld%c", ins->word,
+                    &ins->value, &delimiter) < 2) {
+                return false;
+            }
+            ins->number = find_counter(ins->word);
+            return ins->number >= 0 && ins->value >= 0 &&
+                    (delimiter == ' ' || delimiter == '\0');
+    }
+    return false;
+}
+
+/* Call the relevant command handler for ins */
+int handle_command(struct instruction *ins) 
+{
+    switch(ins->command) {
+        case CMD_EXIT:
+            return handle_exit(ins->number);
+        case CMD_WANT:
+            return handle_want(ins->word, ins->deadline);
+        case CMD_SEND:
+            return handle_send(ins->word, ins->deadline);
+        case CMD_EXISTS:
+            return handle_exists(ins->word);
+        case CMD_SIZE:
+            return handle_size(ins->number, ins->word);
+        case CMD_ECHO:
+            return handle_echo(ins->word);
+        case CMD_ENDINPUT:
+            /* Endinput takes no parameters */
+            return handle_endinput();
+        case CMD_INTERACTIVE:
+            return handle_interactive(ins->word, ins->input);
+        case CMD_LIMIT:
+            return handle_limit(ins->number);
+        case CMD_LATENCY:
+            return handle_latency(ins->percentile, ins->value);
+        case CMD_MAXRSS:
+        case CMD_MAJFLT:
+        case CMD_NVCSW:
+        case CMD_NIVCSW:
+            return handle_usage(ins->command, ins->number);
+        case CMD_UTIME:
+        case CMD_STIME:
+            return handle_usage(ins->command, ins->value);
+        case CMD_COUNTER:
+            return handle_counter(ins->number, ins->value);
+        case CMD_BENCHMARK:
+            return 21;
+        case CMD_INSTANCES:
+            return handle_instances(ins->number);
+        case CMD_NAME:
+        case CMD_AFTER:
+        case CMD_LOCK:
+            return ins->command;    // Only a suite's scheduler uses them
+        case CMD_PTY:
+            return 25;
+        case CMD_PIPESIZE:
+            return 26;
+    }
+    return -1;
+}
+
+/* Split line into a command and params and add it to the block */
+struct instruction *add_instruction(struct block *b, char *line, int lineNo)
+{
+    char *p;        // Scan the line
+
+    if(b->count == b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 8;
+        b->instructions = (struct instruction *)realloc(b->instructions,
+                sizeof(struct instruction) * b->capacity);
+    }
+    struct instruction *ins = &b->instructions[b->count++];
+    memset(ins, 0, sizeof(struct instruction));
+    ins->text = strdup(line);
+    ins->line = lineNo;
+
+    /* Space comes after command, params are whatever follows */
+    for(p = ins->text; *p == ' '; p++) {
+        /* Skip leading spaces */
+    }
+    char *word = p;
+    while(*p != ' ' && *p != '\0') {
+        p++;
+    }
+    size_t length = p - word;
+    if(*p != '\0') {
+        *p++ = '\0';
+        ins->params = *p != '\0' ? p : NULL;
+    }
+
+    /* want and send may be given a deadline, as in want@200ms */
+    char *at = memchr(word, '@', length);
+    if(at != NULL) {
+        *at = '\0';
+        ins->deadline = parse_duration(at + 1);
+        length = at - word;
+    }
+
+    const struct command *c = find_command(word, length);
+    if(c != NULL && (at == NULL || (ins->deadline > 0 &&
+            (c->id == CMD_WANT || c->id == CMD_SEND)))) {
+        ins->name = c->name;
+        ins->command = c->id;
+        ins->args = c->args;
+    }
+    if(ins->params != NULL && (ins->args == ARGS_WORD ||
+            ins->args == ARGS_SIZE || ins->args == ARGS_COUNTER)) {
+        ins->wordSpace = (char *)malloc(strlen(ins->params) + 1);
+    }
+    return ins;
+}
+
+/* When the script comes from stdin, interactive input is the script
+ * lines that follow, up to and including the terminator. Take them now
+ * so they aren't read as commands. */
+void take_interactive_input(struct instruction *ins, struct reader *input)
+{
+    char *word = ins->word;
+    char *line;
+    size_t length = 0;
+
+    ins->input = strdup("");
+    while((line = reader_line(input)) != NULL) {
+        ins->input = (char *)realloc(ins->input, length + strlen(line) + 2);
+        length += sprintf(ins->input + length, "%s\n", line);
+        if(strcmp(line, word) == 0) {
+            break;
+        }
+    }
+}
+
+/* Pair up each repeat with its end. Repeats can't be nested, and a
+ * repeat or end without a partner is an invalid command. */
+void match_repeats(struct block *b)
+{
+    int open = -1;  // Index of the repeat waiting for its end
+
+    for(int i = 0; i < b->count; i++) {
+        struct instruction *ins = &b->instructions[i];
+        if(ins->command == CMD_REPEAT) {
+            if(open != -1) {
+                ins->command = 0;
+                continue;
+            }
+            open = i;
+        } else if(ins->command == CMD_END) {
+            if(open == -1) {
+                ins->command = 0;
+                continue;
+            }
+            ins->jump = open;
+            b->instructions[open].jump = i;
+            open = -1;
+        } else if(open != -1 && ins->params != NULL &&
+                strchr(ins->params, '%') != NULL) {
+            /* Leave room for the counter to be written in */
+            ins->expanded = (char *)malloc(strlen(ins->params) * 6 + 1);
+            ins->wordSpace = (char *)realloc(ins->wordSpace,
+                    strlen(ins->params) * 6 + 1);
+        }
+    }
+    if(open != -1) {
+        b->instructions[open].command = 0;
+    }
+}
+
+/* Check the arguments of every instruction now, unless they change with
+ * a repeat counter. A command with bad arguments is invalid. */
+void parse_block_args(struct block *b)
+{
+    for(int i = 0; i < b->count; i++) {
+        struct instruction *ins = &b->instructions[i];
+        if(ins->command != 0 && ins->expanded == NULL &&
+                !parse_args(ins, ins->params)) {
+            ins->command = 0;
+        }
+        if(ins->command == CMD_COUNTER) {
+            b->counters = true;
+        } else if(ins->command == CMD_BENCHMARK) {
+            b->benchmark = true;
+        } else if(ins->command == CMD_PTY) {
+            b->pty = true;
+        } else if(ins->command == CMD_PIPESIZE) {
+            b->pipeSize = ins->number;
+        }
+        b->sends = b->sends || ins->command == CMD_SEND ||
+                ins->command == CMD_INTERACTIVE;
+        b->wants = b->wants || ins->command == CMD_WANT ||
+                ins->command == CMD_INTERACTIVE;
+    }
+}
+
+/* Note how many instances of the block should run. Only one instances
+ * per block, and each instance needs stdin to itself for interactive,
+ * so in either case the instances command is invalid. */
+void count_instances(struct block *b)
+{
+    struct instruction *directive = NULL;
+    bool interactive = false;
+
+    b->instances = 1;
+    for(int i = 0; i < b->count; i++) {
+        struct instruction *ins = &b->instructions[i];
+        if(ins->command == CMD_INTERACTIVE) {
+            interactive = true;
+        } else if(ins->command == CMD_INSTANCES) {
+            if(directive != NULL) {
+                ins->command = 0;
+                continue;
+            }
+            directive = ins;
+        }
+    }
+    if(directive == NULL) {
+        return;
+    }
+    if(interactive) {
+        directive->command = 0;
+    } else if(handle_instances(directive->number) != -1) {
+        b->instances = directive->number;
+    }
+}
+
+/* A benchmark block has to run the same way every time, so it can't
+ * take interactive input, and its instances would be timed together */
+void check_benchmark(struct block *b)
+{
+    bool allowed = b->instances == 1;
+
+    for(int i = 0; i < b->count; i++) {
+        allowed = allowed && b->instructions[i].command != CMD_INTERACTIVE;
+    }
+    for(int i = 0; i < b->count && !allowed; i++) {
+        if(b->instructions[i].command == CMD_BENCHMARK) {
+            b->instructions[i].command = 0;
+        }
+    }
+    b->benchmark = b->benchmark && allowed;
+}
+
+/* Gather what the block's name, after and lock commands say, which
+ * matters only when it's run in a suite. A second name is ignored. */
+void collect_annotations(struct block *b)
+{
+    for(int i = 0; i < b->count; i++) {
+        struct instruction *ins = &b->instructions[i];
+        if(ins->expanded != NULL) {
+            continue;   // In a repeat, so not known until it runs
+        }
+        if(ins->command == CMD_NAME) {
+            if(b->name != NULL) {
+                ins->command = 0;
+                continue;
+            }
+            b->name = ins->word;
+        } else if(ins->command == CMD_AFTER) {
+            b->after = (struct instruction **)realloc(b->after,
+                    sizeof(struct instruction *) * (b->afterCount + 1));
+            b->after[b->afterCount++] = ins;
+        } else if(ins->command == CMD_LOCK) {
+            b->locks = (char **)realloc(b->locks,
+                    sizeof(char *) * (b->lockCount + 1));
+            b->locks[b->lockCount++] = ins->word;
+        }
+    }
+}
+
+/* Add line, and the end of it, to the FNV-1a hash h */
+uint64_t hash_line(uint64_t h, const char *line)
+{
+    do {
+        h = (h ^ (unsigned char)*line) * 1099511628211ULL;
+    } while(*line++ != '\0');
+    return h;
+}
+
+/* Read the next block of the script, NULL if there are no more */
+struct block *read_block(struct reader *input)
+{
+    char *line = reader_line(input);
+    if(line == NULL) {
+        return NULL;
+    }
+
+    struct block *b = (struct block *)calloc(1, sizeof(struct block));
+    b->number = input->block++;
+    b->line = input->line++;
+    if(block_end(line)) {
+        /* Blank where a program should be */
+        b->ended = true;
+        return b;
+    }
+    b->program = strdup(line);
+    b->hash = hash_line(14695981039346656037ULL, line);
+
+    while((line = reader_line(input)) != NULL) {
+        if(block_end(line)) {
+            b->ended = true;
+            ++input->line;
+            break;
+        }
+        b->hash = hash_line(b->hash, line);
+        struct instruction *ins = add_instruction(b, line, input->line++);
+        if(ins->command == CMD_INTERACTIVE && input == terminal &&
+                parse_args(ins, ins->params)) {
+            take_interactive_input(ins, input);
+        }
+    }
+    match_repeats(b);
+    parse_block_args(b);
+    count_instances(b);
+    check_benchmark(b);
+    collect_annotations(b);
+    return b;
+}
+
+void free_block(struct block *b)
+{
+    for(int i = 0; i < b->count; i++) {
+        free(b->instructions[i].text);
+        free(b->instructions[i].expanded);
+        free(b->instructions[i].wordSpace);
+        free(b->instructions[i].input);
+    }
+    free(b->instructions);
+    free(b->program);
+    free(b->samples);
+    free(b->after);
+    free(b->locks);
+    free(b->lockIds);
+    free(b->waits);
+    free(b->waiters);
+    free(b);
+}
+
+/* Find the end of the first blank line from p on, or return end if
+ * there isn't one. A blank line is two newlines in a row, which SSE2
+ * looks for sixteen positions at a time. */
+const char *find_blank_line(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for(; end - p > 16; p += 16) {
+        __m128i here = _mm_loadu_si128((const __m128i *)p);
+        __m128i after = _mm_loadu_si128((const __m128i *)(p + 1));
+        int pairs = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(here, newline),
+                _mm_cmpeq_epi8(after, newline)));
+        if(pairs != 0) {
+            return p + __builtin_ctz(pairs) + 2;
+        }
+    }
+#endif
+    for(; end - p > 1; p++) {
+        if(p[0] == '\n' && p[1] == '\n') {
+            return p + 2;
+        }
+    }
+    return end;
+}
+
+/* Cut chunks off the script until enough are pending. The lock must be
+ * held. */
+void cut_chunks(struct splitter *s)
+{
+    const char *end = s->map + s->size;
+
+    while(s->pending < s->limit && s->split < s->size) {
+        const char *start = s->map + s->split;
+        const char *cut = end - start > CHUNK_SIZE ?
+                find_blank_line(start + CHUNK_SIZE - 1, end) : end;
+
+        struct chunk *c = (struct chunk *)calloc(1, sizeof(struct chunk));
+        c->text = start;
+        c->length = cut - start;
+        if(s->tail != NULL) {
+            s->tail->next = c;
+        } else {
+            s->head = c;
+        }
+        s->tail = c;
+        if(s->waiting == NULL) {
+            s->waiting = c;
+        }
+        s->pending++;
+        s->split += c->length;
+        pthread_cond_signal(&s->work);
+    }
+}
+
+/* Parser thread, which turns chunks into blocks for as long as there
+ * are chunks. Numbering starts again at each chunk, as where it falls
+ * in the script isn't known until the chunks before it are parsed. */
+void *parse_chunks(void *arg)
+{
+    struct splitter *s = (struct splitter *)arg;
+    struct reader r = {-1};
+    struct block *b;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&s->lock);
+    while(true) {
+        struct chunk *c = s->waiting;
+        if(c == NULL) {
+            pthread_cond_wait(&s->work, &s->lock);
+            continue;
+        }
+        s->waiting = c->next;
+        pthread_mutex_unlock(&s->lock);
+
+        /* reader_line writes into its buffer so parse from a copy */
+        r.size = c->length + 1;
+        r.buffer = (char *)malloc(sizeof(char) * r.size);
+        memcpy(r.buffer, c->text, c->length);
+        r.start = 0;
+        r.end = c->length;
+        r.eof = true;
+        r.line = r.block = 1;
+        while((b = read_block(&r)) != NULL) {
+            c->blocks = (struct block **)realloc(c->blocks,
+                    sizeof(struct block *) * (c->count + 1));
+            c->blocks[c->count++] = b;
+        }
+        c->lines = r.line - 1;
+        free(r.buffer);
+
+        pthread_mutex_lock(&s->lock);
+        c->parsed = true;
+        write(s->ready, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+/* Map the script and start parsing it on threads if it's big enough to
+ * be worth it, otherwise leave it to be read */
+void start_splitter(int fd)
+{
+    /* The run keeps one CPU and the parsers get the rest */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    struct stat info;
+    if(cpus < 1 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+            info.st_size < HUGE_SCRIPT) {
+        return;
+    }
+    char *map = (char *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+            fd, 0);
+    if(map == MAP_FAILED) {
+        return;
+    }
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+    struct splitter *s = (struct splitter *)calloc(1,
+            sizeof(struct splitter));
+    s->map = map;
+    s->size = info.st_size;
+    s->ready = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+
+    int parsers = 0;
+    pthread_t thread;
+    while(parsers < (cpus < MAX_PARSERS ? cpus : MAX_PARSERS) &&
+            s->ready >= 0 &&
+            pthread_create(&thread, NULL, parse_chunks, s) == 0) {
+        pthread_detach(thread);
+        parsers++;
+    }
+    if(parsers == 0) {
+        munmap(map, info.st_size);
+        free(s);
+        return;
+    }
+    /* A chunk for each parser beyond the one being run */
+    s->limit = parsers + 1;
+    splitter = s;
+}
+
+/* Find where every block of the script starts by counting its lines */
+struct block_start *scan_blocks(int fd, uint32_t *count)
+{
+    struct block_start *starts = NULL;
+    char buffer[READ_LEN];
+    uint64_t offset = 0;    // Of buffer[0] in the script
+    uint32_t line = 1;
+    bool lineStart = true;  // Whether the next byte starts a line
+    bool blockStart = true; // Whether the next line starts a block
+    ssize_t n;
+
+    *count = 0;
+    lseek(fd, 0, SEEK_SET);
+    while((n = read(fd, buffer, READ_LEN)) > 0) {
+        char *p = buffer, *end = buffer + n;
+        while(p < end) {
+            if(lineStart && blockStart) {
+                if((*count & (*count - 1)) == 0) {
+                    starts = (struct block_start *)realloc(starts,
+                            sizeof(struct block_start) *
+                            (*count ? *count * 2 : 1));
+                }
+                starts[*count].offset = offset + (p - buffer);
+                starts[(*count)++].line = line;
+                blockStart = false;
+            }
+            if(lineStart && *p == '\n') {
+                /* A blank line, so a block starts after it */
+                blockStart = true;
+                line++;
+                p++;
+                continue;
+            }
+            char *newline = memchr(p, '\n', end - p);
+            lineStart = newline != NULL;
+            if(newline == NULL) {
+                break;
+            }
+            line++;
+            p = newline + 1;
+        }
+        offset += n;
+    }
+    return starts;
+}
+
+/* Fill in what identifies the script for its index */
+void index_identity(int fd, uint64_t identity[5])
+{
+    struct stat info;
+
+    memset(identity, 0, sizeof(uint64_t) * 5);
+    if(fstat(fd, &info) == 0) {
+        identity[0] = info.st_dev;
+        identity[1] = info.st_ino;
+        identity[2] = info.st_size;
+        identity[3] = info.st_mtim.tv_sec;
+        identity[4] = info.st_mtim.tv_nsec;
+    }
+}
+
+/* Read the index of the script from indexFile, or return NULL if it
+ * isn't there or was made from something else */
+struct block_start *load_index(char *indexFile, int fd, uint32_t *count)
+{
+    char magic[8];
+    uint32_t header[2];     // Version, blocks
+    uint64_t identity[5], saved[5];
+    struct block_start *starts = NULL;
+    FILE *in = fopen(indexFile, "rb");
+
+    if(in == NULL) {
+        return NULL;
+    }
+    index_identity(fd, identity);
+    if(fread(magic, 1, 8, in) == 8 && !memcmp(magic, INDEX_MAGIC, 8) &&
+            fread(header, sizeof(uint32_t), 2, in) == 2 &&
+            header[0] == INDEX_VERSION &&
+            fread(saved, sizeof(uint64_t), 5, in) == 5 &&
+            !memcmp(saved, identity, sizeof(identity))) {
+        starts = (struct block_start *)malloc(sizeof(struct block_start) *
+                (header[1] ? header[1] : 1));
+        for(uint32_t i = 0; i < header[1] && starts != NULL; i++) {
+            if(fread(&starts[i].offset, sizeof(uint64_t), 1, in) != 1 ||
+                    fread(&starts[i].line, sizeof(uint32_t), 1, in) != 1) {
+                free(starts);
+                starts = NULL;
+            }
+        }
+        *count = header[1];
+    }
+    fclose(in);
+    return starts;
+}
+
+/* Replace file with the size bytes at data, so that anyone reading it
+ * sees either all of the old or all of the new. They're written to a
+ * temporary file which is synced and renamed over it, so a crash also
+ * leaves one or the other, never part of either. Says whether it
+ * worked. */
+bool replace_file(char *file, const char *data, size_t size)
+{
+    char temp[strlen(file) + 8];
+    sprintf(temp, "%s.XXXXXX", file);
+    int out = mkstemp(temp);
+    if(out < 0) {
+        return false;
+    }
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(out, 0666 & ~mask);  // As if it had been created normally
+
+    bool failed = write_all(out, data, size) != 0 || fsync(out) != 0;
+    if(close(out) != 0 || failed || rename(temp, file) != 0) {
+        unlink(temp);
+        return false;
+    }
+
+    /* Make the rename itself last */
+    char *slash = strrchr(file, '/');
+    char *dir = slash == NULL ? strdup(".") :
+            strndup(file, slash == file ? 1 : slash - file);
+    int dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    free(dir);
+    return true;
+}
+
+/* Replace indexFile with the script's index. The index only saves time,
+ * so it not being written isn't an error. */
+void save_index(char *indexFile, int fd, struct block_start *starts,
+        uint32_t count)
+{
+    uint32_t header[2] = {INDEX_VERSION, count};
+    uint64_t identity[5];
+
+    index_identity(fd, identity);
+
+    /* Written in one go, laid out as load_index reads it */
+    size_t size = 8 + sizeof(header) + sizeof(identity) +
+            (size_t)count * (sizeof(uint64_t) + sizeof(uint32_t));
+    char *image = (char *)malloc(size), *p = image;
+    memcpy(p, INDEX_MAGIC, 8);
+    memcpy(p += 8, header, sizeof(header));
+    memcpy(p += sizeof(header), identity, sizeof(identity));
+    p += sizeof(identity);
+    for(uint32_t i = 0; i < count; i++) {
+        memcpy(p, &starts[i].offset, sizeof(uint64_t));
+        memcpy(p += sizeof(uint64_t), &starts[i].line, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+    }
+    replace_file(indexFile, image, size);
+    free(image);
+}
+
+/* Whether the program line of the block starting at start matches the
+ * filter. It's read on its own, up to where the next block starts. */
+bool program_matches(int fd, struct block_start *start, uint64_t end)
+{
+    char line[READ_LEN];
+    size_t most = end - start->offset < READ_LEN - 1 ?
+            end - start->offset : READ_LEN - 1;
+    ssize_t n = pread(fd, line, most, start->offset);
+
+    if(n <= 0 || line[0] == '\n') {
+        return false;   // No program to match
+    }
+    line[n] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+    return regexec(&filter, line, 0, NULL, 0) == 0;
+}
+
+/* Load or make the script's index, and pick out the blocks in the range
+ * whose programs match the filter. Returns false, saying why, if the
+ * range goes past the script's last block or nothing was picked, as
+ * running nothing would look like a pass */
+bool select_blocks(char *file, int fd)
+{
+    struct selection *sel = (struct selection *)calloc(1,
+            sizeof(struct selection));
+    uint32_t count;
+    char indexFile[strlen(file) + 7];
+
+    sprintf(indexFile, "%s.index", file);
+    sel->starts = load_index(indexFile, fd, &count);
+    if(sel->starts == NULL) {
+        sel->starts = scan_blocks(fd, &count);
+        save_index(indexFile, fd, sel->starts, count);
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    struct stat info;
+    fstat(fd, &info);
+    for(int n = firstBlock; n <= lastBlock && (uint32_t)n <= count; n++) {
+        uint64_t end = (uint32_t)n < count ? sel->starts[n].offset :
+                (uint64_t)info.st_size;
+        if(filtering && !program_matches(fd, &sel->starts[n - 1], end)) {
+            continue;
+        }
+        if((sel->count & (sel->count - 1)) == 0) {
+            sel->picked = (int *)realloc(sel->picked, sizeof(int) *
+                    (sel->count ? sel->count * 2 : 1));
+        }
+        sel->picked[sel->count++] = n;
+    }
+    selection = sel;
+
+    if((uint32_t)firstBlock > count ||
+            (lastBlock != INT_MAX && (uint32_t)lastBlock > count)) {
+        fprintf(stderr, "%s ends at block %u.\n", file, count);
+        return false;
+    }
+    if(sel->count == 0) {
+        fprintf(stderr, "No blocks of %s match the filter.\n", file);
+        return false;
+    }
+    return true;
+}
+
+/* Get the next block of the script to run, from where the index says
+ * it is if only some are run, or from the parsers if it's mapped */
+struct block *next_block(struct reader *input)
+{
+    struct splitter *s = splitter;
+    struct pollfd ready;
+    uint64_t parsed;
+
+    if(selection != NULL) {
+        /* Seek unless it follows straight on from the last one */
+        struct selection *sel = selection;
+        if(sel->next == sel->count) {
+            return NULL;
+        }
+        int n = sel->picked[sel->next++];
+        if(n != sel->last + 1) {
+            lseek(input->fd, sel->starts[n - 1].offset, SEEK_SET);
+            reader_reset(input, input->fd);
+        }
+        input->line = sel->starts[n - 1].line;
+        input->block = n;
+        sel->last = n;
+        return read_block(input);
+    }
+    if(s == NULL) {
+        return read_block(input);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while(true) {
+        cut_chunks(s);
+        struct chunk *c = s->head;
+        if(c == NULL) {
+            break;
+        }
+        if(!c->parsed) {
+            pthread_mutex_unlock(&s->lock);
+            ready.fd = s->ready;
+            ready.events = POLLIN;
+            if(wait_for_events(&ready, 1, -1) > 0) {
+                read(s->ready, &parsed, sizeof(parsed));
+            }
+            pthread_mutex_lock(&s->lock);
+            continue;
+        }
+        if(s->taken < c->count) {
+            struct block *b = c->blocks[s->taken++];
+            pthread_mutex_unlock(&s->lock);
+
+            /* Number it by where it is in the whole script */
+            b->number += s->block;
+            b->line += s->line;
+            for(int i = 0; i < b->count; i++) {
+                b->instructions[i].line += s->line;
+            }
+            return b;
+        }
+
+        /* Every block handed out, so its pages can go */
+        s->head = c->next;
+        if(s->head == NULL) {
+            s->tail = NULL;
+        }
+        s->pending--;
+        s->taken = 0;
+        s->line += c->lines;
+        s->block += c->count;
+        size_t done = (c->text + c->length - s->map) &
+                ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        if(done > s->dropped) {
+            madvise(s->map + s->dropped, done - s->dropped, MADV_DONTNEED);
+            s->dropped = done;
+        }
+        free(c->blocks);
+        free(c);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* Fill in the params of ins with each %i replaced by the repeat
+ * counter and each %% by %. */
+char *expand_counter(struct instruction *ins, int counter)
+{
+    char *in = ins->params, *out = ins->expanded;
+
+    while(*in != '\0') {
+        if(in[0] == '%' && in[1] == 'i') {
+            out += sprintf(out, "%d", counter);
+            in += 2;
+        } else if(in[0] == '%' && in[1] == '%') {
+            *out++ = '%';
+            in += 2;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+    return ins->expanded;
+}
+
+/* Print the latency percentiles of the repeat iterations in a block */
+void report_loops(int block)
+{
+    printf("Block %d: %llu iterations, p50 %.1fus, p99 %.1fus, "
+            "p999 %.1fus\n", block, loopLatency.total,
+            histogram_percentile(&loopLatency, 0.5) / 1000.0,
+            histogram_percentile(&loopLatency, 0.99) / 1000.0,
+            histogram_percentile(&loopLatency, 0.999) / 1000.0);
+}
+
+void run_block(struct block *b);
+
+/* Run every instance of a block at once, each in its own process
+ * with its own copy of the program, then report how they did.
+ * Fails the way the first failed instance did. */
+void run_instances(struct block *b)
+{
+    int n = b->instances;
+    struct instance_result *results, *failed = NULL;
+    struct histogram *latency = &loopLatency;
+    long long elapsed[n];
+    int passed = 0;
+
+    results = (struct instance_result *)mmap(NULL,
+            sizeof(struct instance_result) * n, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(results == MAP_FAILED) {
+        perror("mmap failed");
+        exit(errno);
+    }
+
+    fflush(stdout);     // Or every instance prints it again
+    long long start = now_ns();
+    for(int i = 0; i < n; i++) {
+        results[i].code = -1;   // Stays that way if it dies unexpectedly
+        pid_t worker = fork();
+        if(worker < 0) {
+            perror("Fork failed");
+            exit(errno);
+        }
+        if(!worker) {
+            instanceResult = &results[i];
+            prctl(PR_SET_CHILD_SUBREAPER, 1);   // Not inherited
+            traceTrack = i + 1;
+            traceCount = 0;     // The parent's events are its to write
+            long long begun = now_ns();
+            run_block(b);
+            instanceResult->elapsed = now_ns() - begun;
+            memcpy(&instanceResult->latency, &loopLatency,
+                    sizeof(struct histogram));
+            instanceResult->code = 0;
+            fflush(stdout);
+            trace_flush();
+            _exit(0);
+        }
+    }
+    pid_t reaped;
+    while((reaped = waitpid(-1, NULL, WNOHANG)) >= 0) {
+        if(reaped == 0) {
+            wait_for_events(NULL, 0, -1);   // Until the next SIGCHLD
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    /* Gather instance times and iteration times across instances */
+    histogram_reset(latency);
+    for(int i = 0; i < n; i++) {
+        if(results[i].code != 0) {
+            failed = failed != NULL ? failed : &results[i];
+            continue;
+        }
+        elapsed[passed++] = results[i].elapsed;
+        for(int j = 0; j < HIST_SIZE; j++) {
+            latency->counts[j] += results[i].latency.counts[j];
+        }
+        latency->total += results[i].latency.total;
+    }
+
+    struct histogram *times = (struct histogram *)calloc(1,
+            sizeof(struct histogram));
+    for(int i = 0; i < passed; i++) {
+        histogram_record(times, elapsed[i]);
+    }
+    printf("Block %d: %d instances, %d passed, %d failed, %.1f instances/s, "
+            "p50 %.1fms, p99 %.1fms, p999 %.1fms\n", b->number, n, passed,
+            n - passed, n / seconds,
+            histogram_percentile(times, 0.5) / 1e6,
+            histogram_percentile(times, 0.99) / 1e6,
+            histogram_percentile(times, 0.999) / 1e6);
+    if(latency->total > 0) {
+        printf("Block %d: %llu iterations, %.1f iterations/s, p50 %.1fus, "
+                "p99 %.1fus, p999 %.1fus\n", b->number, latency->total,
+                latency->total / seconds,
+                histogram_percentile(latency, 0.5) / 1000.0,
+                histogram_percentile(latency, 0.99) / 1000.0,
+                histogram_percentile(latency, 0.999) / 1000.0);
+    }
+    free(times);
+
+    int code = failed != NULL ? failed->code : 0;
+    int where = failed != NULL ? failed->where : 0;
+    munmap(results, sizeof(struct instance_result) * n);
+    if(code == -1) {
+        throw_error(ERR_COMMAND, b->line, NULL);
+    } else if(code != 0) {
+        throw_error(code, where, NULL);
+    }
+}
+
+/* Whether performance counters are wanted on b's program */
+bool count_block(struct block *b)
+{
+    return timing || b->counters || (b->benchmark && trials > 0);
+}
+
+/* Run the program of a block, or adopt the one prepared for it, and
+ * check each of its commands */
+void run_commands(struct block *b)
+{
+    int counter = 0;            // Current repeat iteration, 0 outside
+    int iterations = 0;         // Iterations of the current repeat
+    long long begun = 0;        // When the current iteration began
+    long long sent = 0;         // First send of the current iteration
+    long long wanted = 0;       // Last want of the current iteration
+    long long exchange = 0;     // Send waiting on a want, 0 if none
+
+    blockCount = b->number;
+    lineCount = b->line;
+    histogram_reset(&loopLatency);
+    histogram_reset(&exchangeLatency);
+    memset(&blockUsage, 0, sizeof(struct rusage));
+    memset(&childUsage, 0, sizeof(struct rusage));
+    orphans = 0;
+    b->started = now_ns();
+
+    /* Blank line where the program should be */
+    if(b->program == NULL) {
+        throw_error(ERR_BLOCK, blockCount, NULL);
+    }
+    /* First line of block is program to run */
+    if(prepared.pid != -1 ? adopt_child(&prepared) :
+            run_new_process(b)) {
+        throw_error(ERR_COMMAND, lineCount, NULL);
+    }
+    trace("spawn", b->number, b->line, b->started);
+
+    for(int i = 0; i < b->count; i++) {
+        struct instruction *ins = &b->instructions[i];
+        lineCount = ins->line;
+
+        /* Arguments with a counter in them are only known now */
+        if(counter > 0 && ins->expanded != NULL &&
+                !parse_args(ins, expand_counter(ins, counter))) {
+            throw_error(ERR_COMMAND, lineCount, NULL);
+        }
+
+        if(ins->command == CMD_REPEAT) {
+            iterations = ins->number;
+            if(iterations == 0) {
+                i = ins->jump;  // Skip the body altogether
+                continue;
+            }
+            counter = 1;
+            begun = now_ns();
+            sent = wanted = 0;
+        } else if(ins->command == CMD_END) {
+            long long now = now_ns();
+            histogram_record(&loopLatency, (wanted ? wanted : now) -
+                    (sent ? sent : begun));
+            if(counter < iterations) {
+                counter++;
+                i = ins->jump;  // Back to the top of the body
+                begun = now;
+                sent = wanted = 0;
+            } else {
+                counter = 0;
+            }
+        } else {
+            /* Stamp the send before it goes, the reply can beat it back */
+            if(ins->command == CMD_SEND && (!exchange ||
+                    (counter > 0 && !sent))) {
+                long long now = now_ns();
+                exchange = exchange ? exchange : now;
+                sent = counter > 0 && !sent ? now : sent;
+            }
+            long long start = traceFd >= 0 ? now_ns() : 0;
+            if(handle_command(ins) == -1) {
+                throw_error(ERR_COMMAND, lineCount, NULL);
+            }
+            trace(ins->name, b->number, ins->line, start);
+            if(ins->command == CMD_WANT && (exchange || counter > 0)) {
+                long long now = now_ns();
+                if(exchange) {
+                    lastExchange = now - exchange;
+                    histogram_record(&exchangeLatency, lastExchange);
+                    exchange = 0;
+                }
+                wanted = counter > 0 ? now : wanted;
+            }
+        }
+    }
+}
+
+/* Check the block ended properly, then clean up after it. A block cut
+ * short by the end of the script isn't checked for an exit, but its
+ * program is still taken down. */
+void finish_block(struct block *b)
+{
+    blockCount = b->number;
+    if(b->ended && !sawExit) {
+        throw_error(ERR_BLOCK, blockCount, NULL);
+    }
+
+    /* Block has ended, init for next block */
+    long long begun = now_ns();
+    b->elapsed = begun - b->started;
+    if(childOut->fd != -1) {
+        close(childOut->fd);    // No child to read from
+    }
+    handle_endinput();          // No child to write to
+    terminate_group(pid, sawExit);  // Kill the child and its helpers
+    pid = -1;                   // Child killed, no longer exists
+    reap_orphans();             // And anything that got away
+    alarm(0);                   // Cancel timer
+    sawLimit = sawExit = false; // Reset limit/exit
+    b->teardown = now_ns() - begun;
+    trace("teardown", b->number, b->line, begun);
+    trace("block", b->number, b->line, b->started);
+
+    /* Instances and trials report for themselves */
+    bool report = (instanceResult == NULL ||
+            instanceResult == workerResult) && !quiet;
+    if(loopLatency.total > 0 && report) {
+        report_loops(b->number);
+    }
+    if(timing && report) {
+        printf("Block %d: %.3fms, teardown %.3fms, user %.3fms, "
+                "system %.3fms, %d orphans reaped\n", b->number,
+                (now_ns() - b->started) / 1e6, b->teardown / 1e6,
+                blockUsage.ru_utime.tv_sec * 1e3 +
+                blockUsage.ru_utime.tv_usec / 1e3,
+                blockUsage.ru_stime.tv_sec * 1e3 +
+                blockUsage.ru_stime.tv_usec / 1e3, orphans);
+    }
+    finish_counters(b->number, timing && report);
+}
+
+/* Run the program of a block and check each of its commands */
+void run_block(struct block *b)
+{
+    run_commands(b);
+    finish_block(b);
+}
+
+/* Whether b's program can be started before the block before it has
+ * finished. Instances start their own, and a bad program line should
+ * fail when its block is reached. */
+bool can_prepare(struct block *b)
+{
+    return b->program != NULL && *b->program != ' ' && b->instances == 1;
+}
+
+/* Record what the block that has just finished took as trial t */
+void record_trial(struct block *b, int t)
+{
+    double *sample = b->samples + t;    // Measure m is at sample[m * trials]
+
+    sample[0] = b->elapsed;
+    sample[trials] = timeval_ns(&blockUsage.ru_utime);
+    sample[trials * 2] = timeval_ns(&blockUsage.ru_stime);
+    sample[trials * 3] = blockUsage.ru_maxrss;
+    sample[trials * 4] = blockUsage.ru_minflt;
+    sample[trials * 5] = blockUsage.ru_majflt;
+    sample[trials * 6] = blockUsage.ru_nvcsw;
+    sample[trials * 7] = blockUsage.ru_nivcsw;
+    for(int i = 0; i < COUNTERS; i++) {
+        sample[trials * (8 + i)] = counted[i] ? counterValues[i] : NAN;
+    }
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Median of the n sorted values in x */
+double median_of(double *x, int n)
+{
+    return n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+}
+
+/* Fill x with the samples of measure m from count trials, sorted, and
+ * return how many there were */
+int gather_samples(double *samples, int count, int m, double *x)
+{
+    int n = 0;
+
+    for(int t = 0; t < count; t++) {
+        if(!isnan(samples[m * count + t])) {
+            x[n++] = samples[m * count + t];
+        }
+    }
+    qsort(x, n, sizeof(double), compare_doubles);
+    return n;
+}
+
+/* How measure m is shown: times in milliseconds, maxrss in kilobytes.
+ * Returns its name */
+const char *describe_metric(int m, double *scale, const char **unit,
+        int *digits)
+{
+    const char *name = m < 8 ? metricNames[m] : counterTypes[m - 8].name;
+    bool time = m < 3 || !strcmp(name, "task-clock");
+
+    *scale = time ? 1e6 : 1;
+    *unit = time ? "ms" : !strcmp(name, "maxrss") ? "KB" : "";
+    *digits = time ? 3 : 1;
+    return name;
+}
+
+/* Print the median, median absolute deviation, minimum and a 95%
+ * confidence interval for the median of each of b's measures over its
+ * trials. The interval runs between order statistics, so it holds
+ * however the times are distributed. */
+void report_trials(struct block *b)
+{
+    double x[trials], deviation[trials], scale;
+    const char *unit;
+    int digits;
+
+    for(int m = 0; m < METRICS; m++) {
+        int n = gather_samples(b->samples, trials, m, x);
+        if(n == 0) {
+            continue;   // A counter that couldn't be had
+        }
+        double median = median_of(x, n);
+        for(int i = 0; i < n; i++) {
+            deviation[i] = fabs(x[i] - median);
+        }
+        qsort(deviation, n, sizeof(double), compare_doubles);
+
+        /* The ranks 1.96 standard deviations either side of n/2 */
+        double spread = 0.98 * sqrt(n);
+        int low = (int)round(n / 2.0 - spread);
+        int high = (int)round(n / 2.0 + 1 + spread);
+        low = low < 1 ? 1 : low;
+        high = high > n ? n : high;
+
+        const char *name = describe_metric(m, &scale, &unit, &digits);
+        printf("Block %d %s: median %.*f%s, MAD %.*f%s, min %.*f%s, "
+                "95%% CI %.*f-%.*f%s, %d trials\n", b->number, name,
+                digits, median / scale, unit,
+                digits, median_of(deviation, n) / scale, unit,
+                digits, x[0] / scale, unit,
+                digits, x[low - 1] / scale, digits, x[high - 1] / scale, unit,
+                n);
+    }
+}
+
+/* One sided p value for the values in x tending to be larger than those
+ * in y, by the Mann-Whitney U test. Uses the normal approximation,
+ * corrected for ties and continuity. x and y must be sorted. */
+double mann_whitney(double *x, int nx, double *y, int ny)
+{
+    int n = nx + ny, i = 0, j = 0;
+    double rankSum = 0;     // Sum of the ranks of x
+    double ties = 0;        // Sum of t^3 - t over groups of t tied values
+
+    while(i < nx || j < ny) {
+        double v = j >= ny || (i < nx && x[i] <= y[j]) ? x[i] : y[j];
+        int tiedX = 0, tiedY = 0;
+        for(; i < nx && x[i] == v; i++) {
+            tiedX++;
+        }
+        for(; j < ny && y[j] == v; j++) {
+            tiedY++;
+        }
+        /* The group shares the mean of ranks i + j - t + 1 to i + j */
+        double t = tiedX + tiedY;
+        rankSum += (2 * (i + j) - t + 1) / 2 * tiedX;
+        ties += t * t * t - t;
+    }
+
+    double u = rankSum - nx * (nx + 1) / 2.0;
+    double variance = (double)nx * ny / 12 *
+            (n + 1 - ties / ((double)n * (n - 1)));
+    if(variance <= 0) {
+        return 1;   // Every value the same
+    }
+    double z = (u - (double)nx * ny / 2 - 0.5) / sqrt(variance);
+    return 0.5 * erfc(z / sqrt(2));
+}
+
+/* The baseline in list for the block with the given hash, NULL if none */
+struct baseline *find_baseline(struct baseline *list, uint64_t hash)
+{
+    for(; list != NULL && list->hash != hash; list = list->next) {
+        /* Keep looking */
+    }
+    return list;
+}
+
+/* Check b's trials against its baseline. A measure has regressed if its
+ * median is more than threshold percent above the baseline's and the
+ * Mann-Whitney test says it's higher at the 5% level. Prints each that
+ * has and returns whether any did. */
+bool compare_baseline(struct block *b, struct baseline *base)
+{
+    double x[trials], y[base->trials], scale;
+    const char *unit;
+    int digits;
+    bool regressed = false;
+
+    for(int m = 0; m < METRICS; m++) {
+        int nx = gather_samples(b->samples, trials, m, x);
+        int ny = gather_samples(base->samples, base->trials, m, y);
+        if(nx < 2 || ny < 2) {
+            continue;
+        }
+        double now = median_of(x, nx), before = median_of(y, ny);
+        if(before <= 0 || now <= before * (1 + threshold / 100)) {
+            continue;
+        }
+        double p = mann_whitney(x, nx, y, ny);
+        if(p < 0.05) {
+            const char *name = describe_metric(m, &scale, &unit, &digits);
+            printf("Block %d %s regressed: median %.*f%s against %.*f%s, "
+                    "+%.1f%%, p %.4f\n", b->number, name,
+                    digits, now / scale, unit, digits, before / scale, unit,
+                    (now / before - 1) * 100, p);
+            regressed = true;
+        }
+    }
+    return regressed;
+}
+
+/* Read the baselines in file. It not existing is only an error if it's
+ * required. Exits if it can't be read. */
+struct baseline *load_baseline(char *file, bool required)
+{
+    struct baseline *list = NULL;
+    char magic[8];
+    uint32_t header[3];     // Version, measures, records
+    FILE *in = fopen(file, "rb");
+
+    if(in == NULL) {
+        if(required || errno != ENOENT) {
+            throw_error(ERR_OPEN, 0, file);
+        }
+        return NULL;
+    }
+    if(fread(magic, 1, 8, in) != 8 || memcmp(magic, BASELINE_MAGIC, 8) ||
+            fread(header, sizeof(uint32_t), 3, in) != 3 ||
+            header[0] != BASELINE_VERSION || header[1] != METRICS) {
+        throw_error(ERR_OPEN, 0, file);
+    }
+    for(uint32_t i = 0; i < header[2]; i++) {
+        struct baseline *base = (struct baseline *)malloc(
+                sizeof(struct baseline));
+        if(fread(&base->hash, sizeof(uint64_t), 1, in) != 1 ||
+                fread(&base->trials, sizeof(uint32_t), 1, in) != 1 ||
+                base->trials == 0) {
+            throw_error(ERR_OPEN, 0, file);
+        }
+        size_t n = (size_t)METRICS * base->trials;
+        base->samples = (double *)malloc(sizeof(double) * n);
+        if(fread(base->samples, sizeof(double), n, in) != n) {
+            throw_error(ERR_OPEN, 0, file);
+        }
+        base->next = list;
+        list = base;
+    }
+    fclose(in);
+    return list;
 }
 
-/* Get the source of input
- * If no file is specified, stdin is used */
-FILE *get_input_source(int argc, char *argv[]) 
+/* Save the trials of the n benchmark blocks to updateFile, keeping what
+ * it already had for other blocks */
+void save_baseline(struct block **benchmarks, int n)
 {
-    if(argc == 1) {
-        return stdin;
+    struct baseline *list = load_baseline(updateFile, false), *base;
+    uint32_t header[3] = {BASELINE_VERSION, METRICS, 0};
+    size_t size = 8 + sizeof(header);
+
+    for(int i = 0; i < n; i++) {
+        if((base = find_baseline(list, benchmarks[i]->hash)) == NULL) {
+            base = (struct baseline *)calloc(1, sizeof(struct baseline));
+            base->hash = benchmarks[i]->hash;
+            base->next = list;
+            list = base;
+        }
+        base->trials = trials;
+        base->samples = benchmarks[i]->samples;     // Freed with the block
+    }
+    for(base = list; base != NULL; base = base->next) {
+        header[2]++;
+        size += sizeof(uint64_t) + sizeof(uint32_t) +
+                sizeof(double) * METRICS * base->trials;
     }
 
-    FILE *input = fopen(argv[1], "r");
-    if(input == NULL) {
-        throw_error(ERR_OPEN, 0, argv[1]);
+    /* Laid out as load_baseline reads it */
+    char *image = (char *)malloc(size), *p = image;
+    memcpy(p, BASELINE_MAGIC, 8);
+    memcpy(p += 8, header, sizeof(header));
+    p += sizeof(header);
+    for(base = list; base != NULL; base = base->next) {
+        size_t count = sizeof(double) * METRICS * base->trials;
+        memcpy(p, &base->hash, sizeof(uint64_t));
+        memcpy(p += sizeof(uint64_t), &base->trials, sizeof(uint32_t));
+        memcpy(p += sizeof(uint32_t), base->samples, count);
+        p += count;
+    }
+    bool saved = replace_file(updateFile, image, size);
+    free(image);
+    if(!saved) {
+        throw_error(ERR_OPEN, 0, updateFile);
     }
-    return input;
 }
 
-/* Append the buffer to the line and return the new line */
-char *append_to_line(char *line, char *buffer) 
+/* Run each of the n benchmark blocks warmup times, then trials times
+ * timing each run, and report on them. Rounds go through every block
+ * in turn so drift in the machine is spread across all of them. */
+void run_trials(struct block **benchmarks, int n)
 {
-    int newLength;
-    newLength = strlen(line) + strlen(buffer);
-    line = (char *)realloc(line, newLength * sizeof(char) + 1);
-    if(line == NULL) {
-        return NULL;
+    for(int i = 0; i < n; i++) {
+        benchmarks[i]->samples = (double *)malloc(sizeof(double) *
+                METRICS * trials);
+    }
+    quiet = true;
+    for(int round = 0; round < warmup + trials; round++) {
+        for(int i = 0; i < n; i++) {
+            run_block(benchmarks[i]);
+            if(round >= warmup) {
+                record_trial(benchmarks[i], round - warmup);
+            }
+        }
+    }
+    /* Report everything before failing on any regression */
+    int regressed = 0;
+    for(int i = 0; i < n; i++) {
+        struct baseline *base = find_baseline(compareBaselines,
+                benchmarks[i]->hash);
+        report_trials(benchmarks[i]);
+        if(base != NULL && compare_baseline(benchmarks[i], base) &&
+                !regressed) {
+            regressed = benchmarks[i]->number;
+        }
+    }
+    if(updateFile != NULL) {
+        save_baseline(benchmarks, n);
+    }
+    for(int i = 0; i < n; i++) {
+        free_block(benchmarks[i]);
+    }
+    if(regressed) {
+        throw_error(ERR_REGRESS, regressed, NULL);
     }
-    return strcat(line, buffer);
 }
 
-/* Return a complete line from the input stream */ 
-char *get_line(FILE *input) 
+/* Parse the file to be used as input, running each block in turn.
+ * Once a block's last command has run, the next block is read and its
+ * program forked while this block is cleaned up. Reading ahead would
+ * hold up clean up while someone types at a terminal, so not then.
+ * Benchmark blocks are kept to be run again for trials at the end. */
+void parse_input(struct reader *input)
 {
-    /* Initilialize an empty line */
-    char *line;
-    line = (char *)malloc(sizeof(char));
-    line[0] = '\0';
+    bool lookahead = !isatty(input->fd);
+    struct block *b = next_block(input), *next;
+    struct block **benchmarks = NULL;
+    int benchmarkCount = 0;
 
-    char buffer[BUFF_LEN];  // Hold a section of a line
-    buffer[0] = '\0';
-
-    int c;                  // Current character
-    int cCount = 0;         // Number of characters read
-
-    while((c = fgetc(input)) != EOF) {
-        if(c == '\n') {
-            return append_to_line(line, buffer);
+    while(b != NULL) {
+        if(b->instances > 1) {
+            blockCount = b->number;
+            run_instances(b);
+            next = next_block(input);
+        } else {
+            run_commands(b);
+            next = next_block(input);
+            if(lookahead && next != NULL && can_prepare(next)) {
+                spawn_child(next, &prepared, true);
+            }
+            finish_block(b);
         }
-
-        if(cCount < BUFF_LEN - 1) {
-            buffer[cCount] = (char)c;
-            buffer[++cCount] = '\0';
+        if(trials > 0 && b->benchmark) {
+            benchmarks = (struct block **)realloc(benchmarks,
+                    sizeof(struct block *) * (benchmarkCount + 1));
+            benchmarks[benchmarkCount++] = b;
         } else {
-            line = append_to_line(line, buffer);
-
-            /* Have another character to take care of */
-            buffer[cCount = 0] = (char)c;
-            buffer[++cCount] = '\0';
+            free_block(b);
         }
+        b = next;
     }
 
-    /* Return NULL if we've reached EOF on a new line*/
-    if(c == EOF && cCount == 0) {
-        free(line); // Free the empty line
-        return NULL;
-    }
-    /* Reached EOF but there's stuff in the buffer */
-    return append_to_line(line, buffer); 
+    run_trials(benchmarks, benchmarkCount);
+    free(benchmarks);
 }
 
-/* Return true if block has ended, false if not */
-bool block_end(char *line) 
+int compare_expected(const void *a, const void *b)
 {
-    return !strcmp(line, "");
+    uint64_t x = ((const struct expected *)a)->hash;
+    uint64_t y = ((const struct expected *)b)->hash;
+    return (x > y) - (x < y);
 }
 
-/* Command Handlers */
-/* Wait for the child process to exit. Pass if exit status is n.
- * Fail if program exists abnormally or exit status does not equal n.
- * Fail if n is not a positive (including 0) integer*/
-int handle_exit(char *params)
+/* Read the block times in historyFile, if there is one yet. Blocks it
+ * doesn't know are guessed to take the average of those it does. */
+void load_history(void)
 {
-    /* Only one exit per block. */
-    if(sawExit) {
-        return -1;
-    }
+    char magic[8];
+    uint32_t header[2];     // Version, records
+    FILE *in = fopen(historyFile, "rb");
 
-    /* Exit takes a positive integer parameter */
-    int n;                  // Store the exit parameter
-    char delimiter = '\0';  // Must be space or '\0'
-    
-    if(params == NULL || sscanf(params, "%d%c", &n, &delimiter) < 1 ||
-            n < 0 || !(delimiter == ' ' || delimiter == '\0')) {
-        return -1;
+    if(in == NULL) {
+        if(errno != ENOENT) {
+            throw_error(ERR_OPEN, 0, historyFile);
+        }
+        return;
     }
-    sawExit = true;
-
-    /* Wait for the child process to exit and handle appropriately */
-    wait(&childStatus);
-    if(WIFEXITED(childStatus)) {
-        if(childStatus >> 8 == n) {
-            return 1;
+    if(fread(magic, 1, 8, in) != 8 || memcmp(magic, HISTORY_MAGIC, 8) ||
+            fread(header, sizeof(uint32_t), 2, in) != 2 ||
+            header[0] != HISTORY_VERSION) {
+        throw_error(ERR_OPEN, 0, historyFile);
+    }
+    history = (struct expected *)malloc(sizeof(struct expected) *
+            (header[1] ? header[1] : 1));
+    double total = 0;
+    for(uint32_t i = 0; i < header[1]; i++) {
+        if(fread(&history[i].hash, sizeof(uint64_t), 1, in) != 1 ||
+                fread(&history[i].ns, sizeof(double), 1, in) != 1) {
+            throw_error(ERR_OPEN, 0, historyFile);
         }
+        total += history[i].ns;
     }
+    fclose(in);
+    historyCount = historySorted = header[1];
+    qsort(history, historyCount, sizeof(struct expected), compare_expected);
+    if(historyCount > 0) {
+        historyGuess = total / historyCount;
+    }
+}
 
-    return -1;
+/* Find the history of a block, NULL if it has none */
+struct expected *find_history(struct block *b)
+{
+    struct expected key = {b->hash, 0};
+    return (struct expected *)bsearch(&key, history, historySorted,
+            sizeof(struct expected), compare_expected);
 }
 
-/* Read a line of text from the child process
- * Pass if it maches params. Fail if not. */
-int handle_want(char *params)
+double expected_time(struct block *b)
 {
-    /* Want takes an arbitrary string parameter */
-    if(params == NULL) {
-        return -1;
-    }
+    struct expected *e = find_history(b);
+    return e != NULL ? e->ns : historyGuess;
+}
 
-    char *line = get_line(readPipe);
-    if(echo) {
-        printf("%s\n", line);
+/* Add a time the block took to its history, weighing it equally with
+ * what was there. New blocks go after the sorted ones. */
+void remember_time(struct block *b, long long ns)
+{
+    struct expected *e = find_history(b);
+
+    if(e != NULL) {
+        e->ns = (e->ns + ns) / 2;
+        return;
     }
-    if(strcmp(line, params) != 0) {
-        return -1;
+    if((historyCount & (historyCount - 1)) == 0) {
+        history = (struct expected *)realloc(history,
+                sizeof(struct expected) *
+                (historyCount ? historyCount * 2 : 1));
     }
-
-    free(line);
-    return 2;
+    history[historyCount].hash = b->hash;
+    history[historyCount++].ns = ns;
 }
 
-/* Send params to the input of the child process
- * Pass provided there is no IO error and endinput has not been
- * executed */
-int handle_send(char *params)
+/* Replace historyFile with what's now known of block times */
+void save_history(void)
 {
-    /* Send takes an arbitrary string parameter */
-    if(params == NULL) {
-        return -1;
-    }
-    
-    char *message = (char *)malloc((strlen(params) + 2) * sizeof(char));
-    strcat(strcpy(message, params), "\n");
+    uint32_t header[2] = {HISTORY_VERSION, historyCount};
+    size_t size = 8 + sizeof(header) +
+            (size_t)historyCount * (sizeof(uint64_t) + sizeof(double));
+    char *image = (char *)malloc(size), *p = image;
 
-    if(fprintf(writePipe, message) < 0 || fflush(writePipe) != 0) {
-        return -1;
+    memcpy(p, HISTORY_MAGIC, 8);
+    memcpy(p += 8, header, sizeof(header));
+    p += sizeof(header);
+    for(int i = 0; i < historyCount; i++) {
+        memcpy(p, &history[i].hash, sizeof(uint64_t));
+        memcpy(p += sizeof(uint64_t), &history[i].ns, sizeof(double));
+        p += sizeof(double);
+    }
+    bool saved = replace_file(historyFile, image, size);
+    free(image);
+    if(!saved) {
+        throw_error(ERR_OPEN, 0, historyFile);
     }
-
-    free(message);
-    return 3;
 }
 
-/* Passes if the file indicated by params exists */
-int handle_exists(char *params)
+/* Record that block i of the script failed, and fail every block left
+ * waiting on it, as they can't run now */
+void fail_block(struct script *sc, int i, int code, int where)
 {
-    /* Exists takes an arbitrary string parameter */
-    if(params == NULL) {
-        return -1;
+    if(i < sc->failed) {
+        sc->failed = i;
+        sc->code = code;
+        sc->where = where;
     }
 
-    /* Check accessability of the file. F_OK checks existence */
-    int error = access(params, F_OK);
-    if(error) {
-        return -1;
+    /* Each block is marked before it's queued, so is queued only once.
+     * A chain of blocks can be as long as the script, too deep to go
+     * through by recursion. */
+    int *queue = (int *)malloc(sizeof(int) * sc->count);
+    int queued = 0;
+    sc->blocks[i]->state = BLOCK_FAILED;
+    sc->left--;
+    queue[queued++] = i;
+    while(queued > 0) {
+        struct block *b = sc->blocks[queue[--queued]];
+        for(int k = 0; k < b->waiterCount; k++) {
+            struct block *next = sc->blocks[b->waiters[k]];
+            if(next->state == BLOCK_WAITING) {
+                next->state = BLOCK_FAILED;
+                sc->left--;
+                queue[queued++] = b->waiters[k];
+            }
+        }
     }
+    free(queue);
+}
 
-    return 4;
+/* Find the lock called name in lockQueues, adding it if it's new */
+int find_lock(char *name)
+{
+    for(int i = 0; i < lockQueueCount; i++) {
+        if(!strcmp(lockQueues[i].name, name)) {
+            return i;
+        }
+    }
+    if((lockQueueCount & (lockQueueCount - 1)) == 0) {
+        lockQueues = (struct lock_queue *)realloc(lockQueues,
+                sizeof(struct lock_queue) *
+                (lockQueueCount ? lockQueueCount * 2 : 1));
+    }
+    struct lock_queue *q = &lockQueues[lockQueueCount];
+    memset(q, 0, sizeof(struct lock_queue));
+    q->name = name;
+    return lockQueueCount++;
 }
 
-/* Params holds an integer n and string S. Pass if the file indicated
- * by S exists and has size bigger than n. Fail otherwise. */
-int handle_size(char *params)
+/* Work out which blocks of the script each block waits for. after can
+ * only name a block before it, so there can't be a cycle; the nearest
+ * one of that name is meant. Then work out how long each block leaves
+ * to run after it starts, for picking the longest first. */
+void plan_script(struct script *sc)
 {
-    /* Size> takes two parameters:
-     *  a positive integer, an arbitrary string */
-    int n;          // The positive integer
-    char *extra;    // The arbitrary string
+    bool annotated = false;
 
-    if(params == NULL) {
-        return -1;
+    sc->left = sc->failed = sc->count;
+    for(int i = 0; i < sc->count; i++) {
+        struct block *b = sc->blocks[i];
+        annotated = annotated || b->name != NULL || b->afterCount > 0 ||
+                b->lockCount > 0;
     }
+    for(int i = 0; i < sc->count; i++) {
+        struct block *b = sc->blocks[i];
+        b->waits = (int *)malloc(sizeof(int) * (b->afterCount + 1));
+        if(!annotated && i > 0) {
+            b->waits[b->waitCount++] = i - 1;
+        }
+        for(int k = 0; k < b->afterCount; k++) {
+            int j = i - 1;
+            while(j >= 0 && (sc->blocks[j]->name == NULL ||
+                    strcmp(sc->blocks[j]->name, b->after[k]->word))) {
+                j--;
+            }
+            if(j < 0 && b->state == BLOCK_WAITING) {
+                fail_block(sc, i, ERR_COMMAND, b->after[k]->line);
+            }
+            if(j >= 0) {
+                b->waits[b->waitCount++] = j;
+            }
+        }
+        for(int k = 0; k < b->waitCount && b->state == BLOCK_WAITING; k++) {
+            if(sc->blocks[b->waits[k]]->state == BLOCK_FAILED) {
+                fail_block(sc, i, 0, 0);
+            }
+        }
 
-    /* Size extra to fit all it would need to */
-    extra = (char *)malloc(strlen(params) * sizeof(char));
-    if(sscanf(params, "%d %s", &n, extra) < 2) {
-        free(extra);
-        return -1;
+        /* Let what it waits for find it when they pass */
+        b->pending = b->waitCount;
+        for(int k = 0; k < b->waitCount; k++) {
+            struct block *before = sc->blocks[b->waits[k]];
+            if((before->waiterCount & (before->waiterCount - 1)) == 0) {
+                before->waiters = (int *)realloc(before->waiters,
+                        sizeof(int) * (before->waiterCount ?
+                        before->waiterCount * 2 : 1));
+            }
+            before->waiters[before->waiterCount++] = i;
+        }
+        b->lockIds = (int *)malloc(sizeof(int) * (b->lockCount + 1));
+        for(int k = 0; k < b->lockCount; k++) {
+            b->lockIds[k] = find_lock(b->locks[k]);
+        }
     }
 
-    /* Check the file size */
-    struct stat buffer;
-    if(stat(extra, &buffer) || buffer.st_size <= n) {
-        free(extra);
-        return -1;
+    /* Blocks only wait for earlier ones, so go backwards. level holds
+     * the longest time after each block until it's done. */
+    for(int i = 0; i < sc->count; i++) {
+        sc->blocks[i]->level = 0;
+    }
+    for(int i = sc->count - 1; i >= 0; i--) {
+        struct block *b = sc->blocks[i];
+        b->level += expected_time(b);
+        for(int k = 0; k < b->waitCount; k++) {
+            struct block *before = sc->blocks[b->waits[k]];
+            before->level = before->level > b->level ? before->level :
+                    b->level;
+        }
     }
-
-    free(extra);
-    return 5;
 }
 
-/* When output is read from the child process, it should be 
- * copied to stdout. The parameter determines whether echo is off or on
- * By default, echo should be off. Passes if given correct param */
-int handle_echo(char *params)
+/* Add the script at path to the suite, or every script under it if it's
+ * a directory. Hidden files and block indexes are passed over. */
+void add_scripts(char *path, struct script **scripts, int *n)
 {
-    /* Echo takes a string paramter which must be either "on" or
-     * "off" */
-    char *extra; // Holds state of echo as a string
-    if(params == NULL) {
-        return -1;
+    struct stat info;
+    if(stat(path, &info) != 0) {
+        throw_error(ERR_OPEN, 0, path);
     }
 
-    /* Make enough space to hold whatever's thrown at us */
-    extra = (char *)malloc(strlen(params) * sizeof(char));
-    if(sscanf(params, "%s %*s", extra) < 1) {
-        free(extra);
-        return -1;
+    if(S_ISDIR(info.st_mode)) {
+        struct dirent **entries;
+        int count = scandir(path, &entries, NULL, alphasort);
+        if(count < 0) {
+            throw_error(ERR_OPEN, 0, path);
+        }
+        size_t length = strlen(path);
+        bool slash = length > 0 && path[length - 1] == '/';
+        for(int i = 0; i < count; i++) {
+            char *name = entries[i]->d_name;
+            size_t nameLength = strlen(name);
+            if(name[0] != '.' && (nameLength < 6 ||
+                    strcmp(name + nameLength - 6, ".index"))) {
+                char child[length + nameLength + 2];
+                sprintf(child, slash ? "%s%s" : "%s/%s", path, name);
+                add_scripts(child, scripts, n);
+            }
+            free(entries[i]);
+        }
+        free(entries);
+        return;
     }
 
-    if(strcmp(extra, "on") && strcmp(extra, "off")) {
-        free(extra);
-        return -1;
-    }   
-
-    if(strcmp(extra, "on") == 0) {
-        echo = true;    
-    } else {            // Only one or the other because of above
-        echo = false;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        throw_error(ERR_OPEN, 0, path);
     }
+    *scripts = (struct script *)realloc(*scripts,
+            sizeof(struct script) * (*n + 1));
+    struct script *sc = &(*scripts)[(*n)++];
+    memset(sc, 0, sizeof(struct script));
+    sc->path = strdup(path);
 
-    free(extra);
-    return 6;
+    struct reader *input = new_reader(fd);
+    struct block *b;
+    while((b = read_block(input)) != NULL) {
+        sc->blocks = (struct block **)realloc(sc->blocks,
+                sizeof(struct block *) * (sc->count + 1));
+        sc->blocks[sc->count++] = b;
+    }
+    close(fd);
+    free(input->buffer);
+    free(input);
+    plan_script(sc);
 }
 
-/* No more input will be sent to the program. Close the input pipe.
- * Always passes. */
-int handle_endinput(void) 
+/* Print what a script's blocks printed, then how it did */
+void report_script(struct script *sc)
 {
-    fclose(writePipe);
-    return 7;
+    fflush(stdout);
+    write_all(STDOUT_FILENO, sc->output, sc->length);
+    printf("%s: ", sc->path);
+    if(sc->code != 0) {
+        print_error(sc->code, sc->where, sc->path);
+    } else {
+        printf("%d blocks passed, %.3fms\n", sc->passed, sc->elapsed / 1e6);
+    }
+    fflush(stdout);
 }
 
-/* Read lines of input and send them to the program.
- * Stop doing this when W as indicated in params, appears on its own.
- * Passes provided the send operations succeed.
- * If W contains spaces, then only chars before the space will be used.
- * Interactive input is always read from stdin */
-int handle_interactive(char *params)
+/* Whether ready block a should run before b: the one with the longest
+ * expected time left to the end of its script, then the one given
+ * first */
+bool runs_before(struct ready a, struct ready b)
 {
-    /* Interactive takes a single word parameter which must be stored
-     * for future use */
-    char *interactive = NULL;   // Keyword to end interactive mode
-    if(params == NULL) {
-        return -1;
+    double levelA = a.script->blocks[a.block]->level;
+    double levelB = b.script->blocks[b.block]->level;
+
+    if(levelA != levelB) {
+        return levelA > levelB;
+    }
+    if(a.script != b.script) {
+        return a.script < b.script;
     }
+    return a.block < b.block;
+}
 
-    /* Make enough space to hold whatever's thrown at us */
-    interactive = (char *)malloc(strlen(params) * sizeof(char));
-    if(sscanf(params, "%s %*s", interactive) < 1) {
-        free(interactive);
-        return -1;
+/* Add r to the heap */
+void push_ready(struct ready_heap *h, struct ready r)
+{
+    if(h->count == h->capacity) {
+        h->capacity = h->capacity ? h->capacity * 2 : 16;
+        h->items = (struct ready *)realloc(h->items,
+                sizeof(struct ready) * h->capacity);
+    }
+    int i = h->count++;
+    while(i > 0 && runs_before(r, h->items[(i - 1) / 2])) {
+        h->items[i] = h->items[(i - 1) / 2];
+        i = (i - 1) / 2;
     }
+    h->items[i] = r;
+}
 
-    /* Get lines from stdin */
-    char *line;
-    while((line = get_line(stdin)) != NULL) {
-        if(strcmp(line, interactive) == 0) {
+/* Take the block to run first off the heap, which mustn't be empty */
+struct ready pop_ready(struct ready_heap *h)
+{
+    struct ready top = h->items[0], last = h->items[--h->count];
+    int i = 0, child;
+
+    while((child = i * 2 + 1) < h->count) {
+        if(child + 1 < h->count &&
+                runs_before(h->items[child + 1], h->items[child])) {
+            child++;
+        }
+        if(!runs_before(h->items[child], last)) {
             break;
         }
-        
-        handle_send(line);
+        h->items[i] = h->items[child];
+        i = child;
     }
+    h->items[i] = last;
+    return top;
+}
 
-    free(interactive);
-    interactive = NULL;
-    return 8;
+/* Return the index in lockQueues of a lock of b that's held, -1 if
+ * they're all free */
+int held_lock(struct block *b)
+{
+    for(int k = 0; k < b->lockCount; k++) {
+        if(lockQueues[b->lockIds[k]].held) {
+            return b->lockIds[k];
+        }
+    }
+    return -1;
 }
 
-/* Starts a timer. If a block has not been completed before the timer runs 
- * out then finish the block, kill the program and print an error message */
-int handle_limit(char *params)
+/* Move the first block parked on a free lock back to readyBlocks, unless
+ * it needs another lock that's held, in which case it's parked there
+ * instead and the next is tried */
+void wake_lock(int id)
 {
-    /* there can only be one limit per block */
-    if(sawLimit) {
-        return -1;
+    struct lock_queue *q = &lockQueues[id];
+
+    while(!q->held && q->parked.count > 0) {
+        struct ready r = pop_ready(&q->parked);
+        int held = held_lock(r.script->blocks[r.block]);
+        if(held == -1) {
+            push_ready(&readyBlocks, r);
+            return;
+        }
+        push_ready(&lockQueues[held].parked, r);
     }
+}
 
-    /* Limit takes a non-zero positive integer paramter */
-    int n;                  // Store the limit parameter
-    char delimiter = '\0';  // Must be space or '\0'
-    
-    if(params == NULL || sscanf(params, "%d%c", &n, &delimiter) < 1 ||
-            (delimiter != ' ' && delimiter != '\0')) {
-        return -1;
+/* Pick the block to run next, setting *picked to its script and taking
+ * its locks. Of those whose waits have passed and whose locks are free,
+ * it's the one with the longest expected time left to the end of its
+ * script. Ready blocks whose locks are held are parked on one of them
+ * on the way. */
+int pick_block(struct script **picked)
+{
+    while(readyBlocks.count > 0) {
+        struct ready r = pop_ready(&readyBlocks);
+        struct block *b = r.script->blocks[r.block];
+        int held = held_lock(b);
+        if(held == -1) {
+            for(int k = 0; k < b->lockCount; k++) {
+                lockQueues[b->lockIds[k]].held = true;
+            }
+            *picked = r.script;
+            return r.block;
+        }
+        push_ready(&lockQueues[held].parked, r);
+        for(int k = 0; k < b->lockCount; k++) {
+            wake_lock(b->lockIds[k]);   // It can't stand in for them now
+        }
     }
-    alarm(n);
+    return -1;
+}
 
-    sawLimit = true;
-    return 9;
+/* Note that block i of the script has finished, freeing its locks and
+ * readying whatever was waiting on it if it passed */
+void release_block(struct script *sc, int i)
+{
+    struct block *b = sc->blocks[i];
+
+    for(int k = 0; k < b->lockCount; k++) {
+        lockQueues[b->lockIds[k]].held = false;
+    }
+    for(int k = 0; k < b->lockCount; k++) {
+        wake_lock(b->lockIds[k]);
+    }
+    for(int k = 0; k < b->waiterCount && b->state == BLOCK_PASSED; k++) {
+        struct block *next = sc->blocks[b->waiters[k]];
+        if(--next->pending == 0 && next->state == BLOCK_WAITING) {
+            push_ready(&readyBlocks, (struct ready){sc, b->waiters[k]});
+        }
+    }
 }
 
-/* Check for valid commands, call relevant command handler */
-int handle_command(char *command, char *params) 
+/* Write s to a file under /proc, saying whether it took */
+bool write_proc(const char *path, const char *s)
 {
-    if(strcmp(command, "exit") == 0) {
-        return handle_exit(params);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    bool written = fd >= 0 && write_all(fd, s, strlen(s)) == 0;
+    if(fd >= 0) {
+        close(fd);
     }
-    if(strcmp(command, "want") == 0) {
-        return handle_want(params);
+    return written;
+}
+
+/* Give this process, and the block it's about to run, a working
+ * directory of its own: the real one overlaid by a tmpfs that takes
+ * every change. It's done in new user and mount namespaces so needs no
+ * privilege, and it all goes at once when the last process in them
+ * does. exists and size> look through the same overlay. */
+bool isolate_cwd(void)
+{
+    char cwd[PATH_MAX], map[64], options[PATH_MAX + 128];
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+
+    if(getcwd(cwd, sizeof(cwd)) == NULL ||
+            unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) {
+        return false;
     }
-    if(strcmp(command, "send") == 0) {
-        return handle_send(params);
+    sprintf(map, "%d %d 1", uid, uid);
+    if(!write_proc("/proc/self/setgroups", "deny") ||
+            !write_proc("/proc/self/uid_map", map)) {
+        return false;
     }
-    if(strcmp(command, "exists") == 0) {
-        return handle_exists(params);
+    sprintf(map, "%d %d 1", gid, gid);
+    if(!write_proc("/proc/self/gid_map", map) ||
+            mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+        return false;   // Or the overlay would show outside
     }
-    if(strcmp(command, "size>") == 0) {
-        return handle_size(params);
+
+    /* The tmpfs is never attached anywhere, only reached through its
+     * descriptor, so it hides nothing */
+    int fs = syscall(SYS_fsopen, "tmpfs", FSOPEN_CLOEXEC);
+    int scratch = fs < 0 || syscall(SYS_fsconfig, fs, FSCONFIG_CMD_CREATE,
+            NULL, NULL, 0) != 0 ? -1 : syscall(SYS_fsmount, fs,
+            FSMOUNT_CLOEXEC, 0);
+    if(scratch < 0 || mkdirat(scratch, "upper", 0700) != 0 ||
+            mkdirat(scratch, "work", 0700) != 0) {
+        return false;
     }
-    if(strcmp(command, "echo") == 0) {
-        return handle_echo(params);
+    snprintf(options, sizeof(options), "lowerdir=%s,upperdir=/proc/self/fd/"
+            "%d/upper,workdir=/proc/self/fd/%d/work", cwd, scratch, scratch);
+    bool mounted = mount("suspect", cwd, "overlay", 0, options) == 0;
+    close(scratch);
+    close(fs);
+
+    /* Step onto the overlay, which is on top of where we are */
+    if(!mounted || chdir(cwd) != 0) {
+        return false;
     }
-    if(strcmp(command, "endinput") == 0) {
-        /* Endinput takes no parameters */
-        return handle_endinput();
+
+    /* Programs found under it before were the real ones rather than
+     * what the overlay shows, so have them found again */
+    size_t length = strlen(cwd);
+    for(struct program **p = &programs; *p != NULL; ) {
+        struct program *prog = *p;
+        if(prog->path[0] != '/' || (!strncmp(prog->path, cwd, length) &&
+                (length == 1 || prog->path[length] == '/'))) {
+            *p = prog->next;
+            close(prog->fd);
+            free(prog->name);
+            free(prog->path);
+            free(prog);
+        } else {
+            p = &prog->next;
+        }
     }
-    if(strcmp(command, "interactive") == 0) {
-        return handle_interactive(params);
+    return true;
+}
+
+/* Run block i of the script in worker w, as an instance would be */
+void start_worker(int w, struct script *sc, int i)
+{
+    struct block *b = sc->blocks[i];
+
+    workerResults[w].code = -1; // Stays that way if it dies unexpectedly
+
+    /* Find the program here, so the worker inherits it already found
+     * rather than searching the PATH for every block */
+    if(b->program != NULL && *b->program != ' ') {
+        size_t length = strcspn(b->program, " ");
+        char name[length + 1];
+        memcpy(name, b->program, length);
+        name[length] = '\0';
+        find_program(name);
     }
-    if(strcmp(command, "limit") == 0) {
-        return handle_limit(params);
+
+    fflush(stdout);
+    pid_t worker = fork();
+    if(worker < 0) {
+        perror("Fork failed");
+        exit(errno);
     }
-    return -1;
+    if(!worker) {
+        instanceResult = workerResult = &workerResults[w];
+        traceProcess = w + 1;
+        traceCount = 0;         // The parent's events are its to write
+        prctl(PR_SET_CHILD_SUBREAPER, 1);   // Not inherited
+        dup2(workers[w].output, STDOUT_FILENO);
+        if(isolate && !isolate_cwd()) {
+            perror("Isolating block failed");
+            _exit(errno);   // Reported as failing on its first line
+        }
+        blockCount = b->number;
+        long long begun = now_ns();
+        if(b->instances > 1) {
+            run_instances(b);
+        } else {
+            run_block(b);
+        }
+        instanceResult->elapsed = now_ns() - begun;
+        instanceResult->code = 0;
+        trace(sc->path, b->number, b->line, begun);
+        fflush(stdout);
+        trace_flush();
+        _exit(0);
+    }
+    workers[w].pid = worker;
+    workers[w].script = sc;
+    workers[w].block = i;
+    b->state = BLOCK_RUNNING;
 }
 
-/* Parse the file to be used as input */
-void parse_input(FILE *input)
+/* Take what worker w's block printed and how it did, and report its
+ * script if that was the last of it */
+void finish_worker(int w)
 {
-    int previousBlock = 0;                  // Keep track of block starts
-    char *line;                             // Current line
-    char *token;                            // Current command token
-    char *command = NULL, *params = NULL;   // Extracted command and params
+    struct script *sc = workers[w].script;
+    struct instance_result *result = &workerResults[w];
+    int i = workers[w].block;
+    struct block *b = sc->blocks[i];
+    int output = workers[w].output;
 
-    while((line = get_line(input)) != NULL) {
-        if(!block_end(line)) {
-            /* First line of block is program to run */
-            if(previousBlock != blockCount) {
-                previousBlock = blockCount;
+    workers[w].pid = -1;
+    off_t printed = lseek(output, 0, SEEK_END);
+    if(printed > 0) {
+        sc->output = (char *)realloc(sc->output, sc->length + printed);
+        if(pread(output, sc->output + sc->length, printed, 0) == printed) {
+            sc->length += printed;
+        }
+        ftruncate(output, 0);
+    }
+    lseek(output, 0, SEEK_SET);
 
-                /* Fork a new process */
-                if(run_new_process(line)) {
-                    throw_error(ERR_COMMAND, lineCount, NULL);
-                }
+    if(result->code == 0) {
+        b->state = BLOCK_PASSED;
+        sc->left--;
+        sc->passed++;
+        sc->elapsed += result->elapsed;
+        remember_time(b, result->elapsed);
+    } else if(result->code == -1) {
+        fail_block(sc, i, ERR_COMMAND, b->line);
+    } else {
+        fail_block(sc, i, result->code, result->where);
+    }
+    release_block(sc, i);
+    if(sc->left == 0) {
+        report_script(sc);
+    }
+}
 
-                free(line);     // Free this line before fetching next
-                ++lineCount;
-                continue;
-            }
+/* Run every block of every script, up to jobs blocks at once, each when
+ * what it waits for has passed. Fails the way the first script to fail
+ * did. */
+int run_suite(struct script *scripts, int n)
+{
+    int running = 0, passed = 0, i;
+    struct script *sc;
 
-            /* Either space or \n comes after command */
-            token = strtok(line, " \n");
-            command = token;
-            while((token = strtok(NULL, "\n")) != NULL) {
-                params = token;
+    workers = (struct worker *)malloc(sizeof(struct worker) * jobs);
+    workerResults = (struct instance_result *)mmap(NULL,
+            sizeof(struct instance_result) * jobs, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(workerResults == MAP_FAILED) {
+        perror("mmap failed");
+        exit(errno);
+    }
+    for(int w = 0; w < jobs; w++) {
+        workers[w].pid = -1;
+        workers[w].output = memfd_create("suspect", MFD_CLOEXEC);
+        if(workers[w].output < 0) {
+            perror("memfd_create failed");
+            exit(errno);
+        }
+    }
+    for(int i = 0; i < n; i++) {
+        if(scripts[i].left == 0) {
+            report_script(&scripts[i]);
+        }
+        for(int j = 0; j < scripts[i].count; j++) {
+            struct block *b = scripts[i].blocks[j];
+            if(b->pending == 0 && b->state == BLOCK_WAITING) {
+                push_ready(&readyBlocks, (struct ready){&scripts[i], j});
             }
-            if(handle_command(command, params) == -1) {
-                throw_error(ERR_COMMAND, lineCount, NULL);
+        }
+    }
+
+    while(true) {
+        for(int w = 0; w < jobs; w++) {
+            if(workers[w].pid == -1 &&
+                    (i = pick_block(&sc)) != -1) {
+                start_worker(w, sc, i);
+                running++;
             }
-            command = params = NULL;
-        } else {
-            /* Block has ended, init for next block */
-            if(!sawExit) {
-                throw_error(ERR_BLOCK, blockCount, NULL);
+        }
+        if(running == 0) {
+            break;
+        }
+
+        /* Programs orphaned by a worker come back to us too */
+        pid_t reaped;
+        while((reaped = waitpid(-1, NULL, WNOHANG)) == 0) {
+            wait_for_events(NULL, 0, -1);   // Until the next SIGCHLD
+        }
+        for(int w = 0; w < jobs; w++) {
+            if(workers[w].pid == reaped) {
+                finish_worker(w);
+                running--;
             }
-            kill(pid, SIGINT);          // Kill the child
-            pid = -1;                   // Child killed, no longer exists
-            fclose(readPipe);           // No child to read from
-            fclose(writePipe);          // No child to write to
-            alarm(0);                   // Cancel timer
-            sawLimit = sawExit = false; // Reset limit/exit
-            previousBlock = blockCount; // Set blockCount
-            blockCount++;
         }
+    }
 
-        free(line); // Free this line before getting the next
-        ++lineCount;
+    int code = 0;
+    for(int i = 0; i < n; i++) {
+        passed += scripts[i].code == 0;
+        code = code != 0 ? code : scripts[i].code;
     }
+    printf("%d of %d scripts passed\n", passed, n);
+    fflush(stdout);
+    if(historyFile != NULL) {
+        save_history();
+    }
+    return code;
 }
 
-/* Handle various signals */
-void handle_sigs(int sigNum)
+/* Take down every worker still running a block, as when told to stop,
+ * and report their scripts */
+void stop_workers(void)
 {
-    switch(sigNum) {
-        case SIGALRM:
-            throw_error(ERR_LIMIT, blockCount, NULL);
-        case SIGUSR1:
-            --lineCount;
-        case SIGPIPE:
-        case SIGSEGV:
-            throw_error(ERR_COMMAND, lineCount, NULL);
+    for(int w = 0; w < jobs; w++) {
+        if(workers[w].pid != -1) {
+            kill(workers[w].pid, SIGTERM);
+        }
+    }
+    for(int w = 0; w < jobs; w++) {
+        if(workers[w].pid != -1) {
+            waitpid(workers[w].pid, NULL, 0);
+            finish_worker(w);
+        }
+    }
+}
+
+/* Act on the signals waiting on the signalfd. SIGCHLD only has to wake
+ * the poll so whoever is waiting on a child looks again. Being told to
+ * stop reports what the block got through before taking it down. */
+void handle_signals(void)
+{
+    struct signalfd_siginfo info;
+
+    while(signals >= 0 &&
+            read(signals, &info, sizeof(info)) == sizeof(info)) {
+        switch(info.ssi_signo) {
+            case SIGALRM:
+                trace_instant("timeout");
+                throw_error(ERR_LIMIT, blockCount, NULL);
+            case SIGINT:
+            case SIGTERM:
+                if(loopLatency.total > 0 && (instanceResult == NULL ||
+                        instanceResult == workerResult) && !quiet) {
+                    report_loops(blockCount);
+                }
+                throw_error(ERR_SIGNAL, blockCount, NULL);
+        }
     }
 }
 
+#ifndef CHECK_COMMANDS
 int main(int argc, char *argv[])
 {
-    /* Set up signal handlers */
-    signal(SIGALRM, handle_sigs);   // Limit timeout
-    signal(SIGUSR1, handle_sigs);   // Exec failed
-    signal(SIGPIPE, handle_sigs);   // Write to pipe failed
-    signal(SIGSEGV, handle_sigs);   // Other stuff failed
+    /* Whatever a block leaves running comes back to us */
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    /* Set up signals, which are read from the signalfd rather than
+     * handled. A write to a closed pipe fails with EPIPE instead. */
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGALRM);   // Limit timeout
+    sigaddset(&handled, SIGCHLD);   // A child has exited
+    sigaddset(&handled, SIGINT);    // Told to stop
+    sigaddset(&handled, SIGTERM);
+    sigprocmask(SIG_BLOCK, &handled, NULL);
+    signals = signalfd(-1, &handled, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(signals < 0) {
+        perror("signalfd failed");
+        exit(errno);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Handle command line options */
+    const struct option options[] = {
+        {"grace", required_argument, NULL, 'g'},
+        {"timing", no_argument, NULL, 't'},
+        {"trials", required_argument, NULL, 'r'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"compare-baseline", required_argument, NULL, 'c'},
+        {"update-baseline", required_argument, NULL, 'u'},
+        {"threshold", required_argument, NULL, 'p'},
+        {"trace", required_argument, NULL, 'x'},
+        {"only-block", required_argument, NULL, 'o'},
+        {"blocks", required_argument, NULL, 'b'},
+        {"filter", required_argument, NULL, 'f'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"history", required_argument, NULL, 'h'},
+        {"isolate", no_argument, NULL, 'i'},
+        {"pipe-size", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    char delimiter;     // Nothing may follow a number
+    bool selecting = false; // Whether only some blocks are run
+    while((opt = getopt_long(argc, argv, "j:", options, NULL)) != -1) {
+        switch(opt) {
+            case 'g':
+                if(sscanf(optarg, "%d%c", &killGrace, &delimiter) != 1 ||
+                        killGrace < 0) {
+                    throw_error(ERR_USAGE, 0, argv[0]);
+                }
+                break;
+            case 't':
+                timing = true;
+                break;
+            case 'r':
+                if(sscanf(optarg, "%d%c", &trials, &delimiter) != 1 ||
+                        trials < 1) {
+                    throw_error(ERR_USAGE, 0, argv[0]);
+                }
+                break;
+            case 'w':
+                if(sscanf(optarg, "%d%c", &warmup, &delimiter) != 1 ||
+                        warmup < 0) {
+                    throw_error(ERR_USAGE, 0, argv[0]);
+                }
+                break;
+            case 'c':
+                compareFile = optarg;
+                break;
+            case 'u':
+                updateFile = optarg;
+                break;
+            case 'p':
+                if(sscanf(optarg, "%lf%c", &threshold, &delimiter) != 1 ||
+                        threshold < 0) {
+                    throw_error(ERR_USAGE, 0, argv[0]);
+                }
+                break;
+            case 'x':
+                traceFd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC |
+                        O_APPEND | O_CLOEXEC, 0666);
+                if(traceFd < 0) {
+                    throw_error(ERR_OPEN, 0, optarg);
+                }
+                traceProcess = getpid();
+                write_all(traceFd, "[\n", 2);
+                break;
+            case 'o':
+                if(sscanf(optarg, "%d%c", &firstBlock, &delimiter) != 1 ||
+                        firstBlock < 1) {
+                    throw_error(ERR_USAGE, 0, argv[0]);
+                }
+                lastBlock = firstBlock;
+                selecting = true;
+                break;
+            case 'b':
+                if(sscanf(optarg, "%d-%d%c", &firstBlock, &lastBlock,
+                        &delimiter) != 2 || firstBlock < 1 ||
+                        lastBlock < firstBlock) {
+                    throw_error(ERR_USAGE, 0, argv[0]);
+                }
+                selecting = true;
+                break;
+            case 'f':
+                if(filtering || regcomp(&filter, optarg,
+                        REG_EXTENDED | REG_NOSUB) != 0) {
+                    throw_error(ERR_USAGE, 0, argv[0]);
+                }
+                filtering = selecting = true;
+                break;
+            case 'j':
+                if(sscanf(optarg, "%d%c", &jobs, &delimiter) != 1 ||
+                        jobs < 1) {
+                    throw_error(ERR_USAGE, 0, argv[0]);
+                }
+                break;
+            case 'h':
+                historyFile = optarg;
+                break;
+            case 'i':
+                isolate = true;
+                break;
+            case 's':
+                if(sscanf(optarg, "%d%c", &pipeSize, &delimiter) != 1 ||
+                        pipeSize < 1) {
+                    throw_error(ERR_USAGE, 0, argv[0]);
+                }
+                break;
+            default:
+                throw_error(ERR_USAGE, 0, argv[0]);
+        }
+    }
+
+    /* More than one script, or a directory of them, makes a suite */
+    struct stat info;
+    bool suite = jobs > 0 || historyFile != NULL || isolate ||
+            argc - optind > 1 ||
+            (argc - optind == 1 && stat(argv[optind], &info) == 0 &&
+            S_ISDIR(info.st_mode));
+    if((selecting && argc - optind != 1) ||
+            ((compareFile != NULL || updateFile != NULL) && trials == 0) ||
+            (suite && (argc - optind == 0 || selecting || trials > 0))) {
+        throw_error(ERR_USAGE, 0, argv[0]);
+    }
+    if(suite) {
+        struct script *scripts = NULL;
+        int n = 0;
+        if(jobs == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = cpus > 0 ? cpus : 1;
+        }
+        if(historyFile != NULL) {
+            load_history();
+        }
+        terminal = new_reader(STDIN_FILENO);
+        childOut = new_reader(-1);
+        for(int i = optind; i < argc; i++) {
+            add_scripts(argv[i], &scripts, &n);
+        }
+        return run_suite(scripts, n);
+    }
+    if(compareFile != NULL) {
+        compareBaselines = load_baseline(compareFile, true);
+    }
 
     /* Handle user input */
-    FILE *input = get_input_source(argc, argv);
-    parse_input(input);
+    int input = get_input_source(optind < argc ? argv[optind] : NULL);
+    terminal = new_reader(STDIN_FILENO);
+    childOut = new_reader(-1);
+    script = input == STDIN_FILENO ? terminal : new_reader(input);
+    if(selecting) {
+        if(!select_blocks(argv[optind], input)) {
+            throw_error(ERR_USAGE, 0, argv[0]);
+        }
+    } else if(input != STDIN_FILENO) {
+        start_splitter(input);
+    }
+    parse_input(script);
+    trace_flush();
 
     return 0;
 }
-
+#endif